@@ -0,0 +1,568 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+ * Paint engine microbenchmarks.
+ *
+ * Usage: paintcore-bench [options]
+ *
+ *   --impl <name>       use the given compositing implementation (see --list)
+ *   --list              list available compositing implementations
+ *   --verify            check that every implementation gives the same
+ *                       results as the generic one and exit
+ *   --filter <text>     run only the benchmarks whose name contains text
+ *   --time <ms>         minimum time to run each benchmark (default 250)
+ *   --save <file>       save results as a baseline
+ *   --compare <file>    compare results against a saved baseline
+ *
+ * Results are reported in pixels/s or dabs/s. The baseline file is
+ * a plain text file with one "name value" pair per line.
+ *
+ * The --verify mode exits with a non-zero status if any result differs,
+ * so it can be run as an automated test.
+ */
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QTextStream>
+#include <QFile>
+#include <QHash>
+#include <QVector>
+#include <QImage>
+#include <QSize>
+
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <functional>
+
+#include "core/rasterop.h"
+#include "core/tile.h"
+#include "core/tilepool.h"
+#include "core/layer.h"
+#include "core/layerstack.h"
+#include "core/brush.h"
+#include "core/brushmask.h"
+#include "core/point.h"
+
+using namespace paintcore;
+
+namespace {
+
+QTextStream out(stdout);
+
+struct Options {
+	Options() : mintime(250) { }
+
+	QString filter;
+	int mintime;
+	QString saveFile;
+	QString compareFile;
+};
+
+Options opts;
+QList<QPair<QString, double>> results;
+QHash<QString, double> baseline;
+
+/**
+ * Run a benchmark function repeatedly until the minimum time has passed.
+ *
+ * @param name benchmark name
+ * @param unit unit of work (e.g. "pixels")
+ * @param itemsPerCall number of work items processed by one call of fn
+ * @param fn benchmark function
+ */
+void bench(const QString &name, const char *unit, qint64 itemsPerCall, std::function<void()> fn)
+{
+	if(!opts.filter.isEmpty() && !name.contains(opts.filter))
+		return;
+
+	// Warm up
+	fn();
+
+	QElapsedTimer timer;
+	qint64 calls = 0;
+	timer.start();
+	do {
+		fn();
+		++calls;
+	} while(timer.elapsed() < opts.mintime);
+
+	const double rate = double(calls * itemsPerCall) / (timer.nsecsElapsed() / 1.0e9);
+	results << qMakePair(name, rate);
+
+	out << QString("%1 %2 %3/s").arg(name, -44).arg(rate / 1.0e6, 12, 'f', 3).arg(QString("M") + unit);
+
+	if(baseline.contains(name)) {
+		const double ratio = rate / baseline.value(name);
+		out << QString("  %1%").arg((ratio - 1.0) * 100.0, 7, 'f', 1);
+	}
+
+	out << endl;
+}
+
+//! Fill a buffer with a repeatable pseudo-random pattern
+void fillPattern(quint32 *data, int len, quint32 seed, bool varyAlpha)
+{
+	quint32 x = seed;
+	for(int i=0;i<len;++i) {
+		x = x * 1103515245 + 12345;
+		data[i] = varyAlpha ? (x >> 1) : ((x >> 1) | 0xff000000);
+	}
+}
+
+/**
+ * Run a compositing operation with the generic and the given implementation
+ * and compare the results. The whole buffer is compared, so writing past
+ * the end of the composited range is caught too.
+ */
+int verify(const QString &impl, const QString &name, const QVector<quint32> &input, int offset, std::function<void(quint32*)> fn)
+{
+	QVector<quint32> expected = input;
+	QVector<quint32> actual = input;
+
+	setRasteropImplementation("generic");
+	fn(expected.data() + offset);
+
+	setRasteropImplementation(impl);
+	fn(actual.data() + offset);
+
+	if(memcmp(expected.constData(), actual.constData(), expected.size() * sizeof(quint32)) == 0)
+		return 0;
+
+	for(int i=0;i<expected.size();++i) {
+		if(expected.at(i) != actual.at(i)) {
+			fprintf(stderr, "%s: %s: pixel %d is %08x, expected %08x\n",
+				qPrintable(impl), qPrintable(name), i - offset, actual.at(i), expected.at(i));
+			break;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Compare all available compositing implementations against the generic one.
+ *
+ * The inputs cover the cases the vectorized versions handle separately:
+ * fully transparent and opaque pixels, mask and opacity values 0 and 255,
+ * lengths that are not a multiple of the vector width and unaligned buffers.
+ *
+ * @return number of mismatching results
+ */
+int verifyCompositing()
+{
+	// Long enough for a few iterations of the widest vector loop
+	const int MAXLEN = 67;
+	const int ROWS = 3;
+	const int MAXOFFSET = 3;
+	const int BUFLEN = (MAXLEN + 1) * ROWS + MAXOFFSET;
+
+	QVector<quint32> random(BUFLEN), edges(BUFLEN), over(BUFLEN);
+	QVector<uchar> mask(BUFLEN + MAXOFFSET);
+
+	fillPattern(random.data(), BUFLEN, 5, true);
+	fillPattern(edges.data(), BUFLEN, 6, true);
+	fillPattern(over.data(), BUFLEN, 7, true);
+	for(int i=0;i<BUFLEN;++i) {
+		switch(i % 4) {
+		case 0: edges[i] &= 0x00ffffff; break;
+		case 1: edges[i] |= 0xff000000; break;
+		case 2: edges[i] = i % 8 == 2 ? 0 : 0xffffffff; break;
+		}
+		if(i % 5 == 0)
+			over[i] &= 0x00ffffff;
+		else if(i % 7 == 0)
+			over[i] |= 0xff000000;
+	}
+	for(int i=0;i<mask.size();++i)
+		mask[i] = i % 3 == 0 ? 0 : i % 3 == 1 ? 255 : (i * 37) % 256;
+
+	QVector<int> modes;
+	for(int m=0;m<BLEND_MODES;++m)
+		modes << m;
+	modes << 255;
+
+	const quint32 colors[] = { 0x80ff8020, 0xff204080, 0x00ffffff };
+	const uchar alphas[] = { 0, 1, 128, 255 };
+
+	const QString original = rasteropImplementation();
+	QStringList impls = availableRasteropImplementations();
+	impls.removeAll("generic");
+
+	int failed = 0;
+	foreach(const QString &impl, impls) {
+		int mismatches = 0;
+		foreach(int mode, modes) {
+			const QString modename = mode == 255 ? QString("Copy") : QString(BLEND_MODE[mode]);
+
+			for(int input=0;input<2;++input) {
+				const QVector<quint32> &base = input ? edges : random;
+
+				for(int offset=0;offset<=MAXOFFSET;++offset) {
+					const uchar *m = mask.constData() + offset;
+
+					for(int len=0;len<=MAXLEN;++len) {
+						const QString params = QString("%1 input=%2 len=%3 offset=%4").arg(modename).arg(input).arg(len).arg(offset);
+
+						for(unsigned int c=0;c<sizeof(colors)/sizeof(*colors);++c) {
+							const quint32 color = colors[c];
+							mismatches += verify(impl, "compositeMask/" + params, base, offset, [&](quint32 *b) {
+								compositeMask(mode, b, color, m, len, 1, 0, 0);
+							});
+							mismatches += verify(impl, "compositeMask/" + params + " rows", base, offset, [&](quint32 *b) {
+								compositeMask(mode, b, color, m, len, ROWS, 1, 1);
+							});
+
+							for(unsigned int a=0;a<sizeof(alphas)/sizeof(*alphas);++a) {
+								const uchar alpha = alphas[a];
+								mismatches += verify(impl, "compositeColor/" + params, base, offset, [&](quint32 *b) {
+									compositeColor(mode, b, color, alpha, len);
+								});
+							}
+						}
+
+						if(mode == 255)
+							continue;
+
+						for(unsigned int a=0;a<sizeof(alphas)/sizeof(*alphas);++a) {
+							const uchar opacity = alphas[a];
+							mismatches += verify(impl, "compositePixels/" + params, base, offset, [&](quint32 *b) {
+								compositePixels(mode, b, over.constData() + MAXOFFSET - offset, len, opacity);
+							});
+						}
+					}
+				}
+			}
+		}
+
+		out << impl << ": " << (mismatches ? QString("%1 mismatches").arg(mismatches) : QString("OK")) << endl;
+		failed += mismatches;
+	}
+
+	setRasteropImplementation(original);
+	if(impls.isEmpty())
+		out << "Only the generic implementation is available" << endl;
+
+	return failed;
+}
+
+void benchCompositing()
+{
+	const int len = Tile::LENGTH;
+	QVector<quint32> base(len), orig(len), over(len);
+	QVector<uchar> mask(len);
+
+	fillPattern(orig.data(), len, 1, true);
+	fillPattern(over.data(), len, 2, true);
+	for(int i=0;i<len;++i)
+		mask[i] = (i * 7) % 256;
+
+	QVector<int> modes;
+	for(int m=0;m<BLEND_MODES;++m)
+		modes << m;
+	modes << 255;
+
+	foreach(int mode, modes) {
+		const QString name = mode == 255 ? QString("Copy") : QString(BLEND_MODE[mode]);
+		base = orig;
+		bench("compositeMask/" + name, "pixels", len, [&]() {
+			compositeMask(mode, base.data(), 0x80ff8020, mask.constData(), Tile::SIZE, Tile::SIZE, 0, 0);
+		});
+	}
+
+	foreach(int mode, modes) {
+		const QString name = mode == 255 ? QString("Copy") : QString(BLEND_MODE[mode]);
+		base = orig;
+		bench("compositeColor/" + name, "pixels", len, [&]() {
+			compositeColor(mode, base.data(), 0x80ff8020, 0x80, len);
+		});
+	}
+
+	foreach(int mode, modes) {
+		if(mode == 255)
+			continue;
+		base = orig;
+		bench(QString("compositePixels/") + BLEND_MODE[mode], "pixels", len, [&]() {
+			compositePixels(mode, base.data(), over.constData(), len, 200);
+		});
+	}
+
+	// Normal mode onto an opaque destination (the layer stack flattening case)
+	fillPattern(orig.data(), len, 1, false);
+	base = orig;
+	bench("compositePixels/Normal onto opaque", "pixels", len, [&]() {
+		compositePixels(1, base.data(), over.constData(), len, 200);
+	});
+}
+
+void benchTiles()
+{
+	QImage img(Tile::SIZE, Tile::SIZE, QImage::Format_ARGB32);
+	fillPattern(reinterpret_cast<quint32*>(img.bits()), Tile::LENGTH, 3, true);
+
+	const Tile src(img);
+	Tile dest(QColor(255, 255, 255));
+
+	bench("Tile::merge/Normal", "pixels", Tile::LENGTH, [&]() {
+		dest.merge(src, 128, 1);
+	});
+
+	bench("Tile::merge/Multiply", "pixels", Tile::LENGTH, [&]() {
+		dest.merge(src, 128, 2);
+	});
+
+	QImage blankimg(Tile::SIZE, Tile::SIZE, QImage::Format_ARGB32);
+	blankimg.fill(0);
+	const Tile blank(blankimg);
+	volatile bool b;
+	bench("Tile::isBlank/blank", "pixels", Tile::LENGTH, [&]() {
+		b = blank.isBlank();
+	});
+
+	bench("Tile::isBlank/nonblank", "pixels", Tile::LENGTH, [&]() {
+		b = src.isBlank();
+	});
+	Q_UNUSED(b);
+}
+
+void benchFlatten()
+{
+	const QSize size(Tile::SIZE*8, Tile::SIZE*8);
+	LayerStack stack;
+	stack.resize(0, size.width(), size.height(), 0);
+
+	// A typical stack: an opaque background and a few partially painted layers
+	stack.addLayer(1, "Background", Qt::white);
+	for(int i=2;i<=5;++i) {
+		Layer *l = stack.addLayer(i, QString("Layer %1").arg(i), Qt::transparent);
+		Brush brush(20, 0.5, 0.8, QColor::fromHsv(i * 60, 200, 200));
+		for(int j=0;j<200;++j)
+			l->dab(1, brush, Point((j * 37 + i * 101) % size.width(), (j * 53 + i * 13) % size.height(), 1.0));
+	}
+	stack.getLayer(3)->setBlend(2);
+	stack.getLayer(4)->setOpacity(128);
+
+	volatile QRgb picked;
+	bench("LayerStack::colorAt/5 layers", "pixels", 1, [&]() {
+		picked = stack.colorAt(100, 100).rgb();
+	});
+	bench("LayerStack::colorAt/5 layers, 11x11 average", "pixels", 11*11, [&]() {
+		picked = stack.colorAt(100, 100, 11).rgb();
+	});
+	Q_UNUSED(picked);
+
+	const int tiles = (size.width() / Tile::SIZE) * (size.height() / Tile::SIZE);
+	quint32 data[Tile::LENGTH];
+	bench("LayerStack::flattenTile/5 layers", "pixels", qint64(tiles) * Tile::LENGTH, [&]() {
+		for(int y=0;y<size.height()/Tile::SIZE;++y)
+			for(int x=0;x<size.width()/Tile::SIZE;++x)
+				stack.flattenTile(data, x, y);
+	});
+
+	// An opaque layer near the top hides everything below it
+	stack.addLayer(6, "Paper", QColor(240, 235, 220));
+	stack.reorderLayers(QList<uint8_t>() << 1 << 2 << 3 << 4 << 6 << 5);
+	bench("LayerStack::flattenTile/6 layers, opaque paper", "pixels", qint64(tiles) * Tile::LENGTH, [&]() {
+		for(int y=0;y<size.height()/Tile::SIZE;++y)
+			for(int x=0;x<size.width()/Tile::SIZE;++x)
+				stack.flattenTile(data, x, y);
+	});
+}
+
+void benchDabs()
+{
+	const QSize size(2048, 2048);
+	Layer layer(0, 1, "", Qt::transparent, size);
+
+	// Pregenerate dab positions so every dab gets a different subpixel offset
+	QVector<Point> points;
+	for(int i=0;i<1000;++i)
+		points << Point(
+			200 + (i * 1619 % 16000) / 10.0,
+			200 + (i * 2971 % 16000) / 10.0,
+			0.2 + (i % 9) / 10.0
+		);
+
+	const int radii[] = {1, 4, 16, 64};
+	for(unsigned int r=0;r<sizeof(radii)/sizeof(*radii);++r) {
+		for(int hard=0;hard<2;++hard) {
+			for(int subpixel=0;subpixel<2;++subpixel) {
+				Brush brush(radii[r], hard ? 1.0 : 0.3, 0.5, Qt::darkBlue);
+				brush.setRadius2(1);
+				brush.setSubpixel(subpixel);
+
+				const QString name = QString("Layer::dab/r=%1 %2 %3")
+						.arg(radii[r])
+						.arg(hard ? "hard" : "soft")
+						.arg(subpixel ? "subpixel" : "whole pixel");
+
+				bench(name, "dabs", points.size(), [&]() {
+					foreach(const Point &p, points)
+						layer.dab(1, brush, p);
+				});
+			}
+		}
+	}
+
+	// A zigzag stroke drawn in one batch, the way PenMove messages are
+	PointVector stroke;
+	for(int i=0;i<100;++i)
+		stroke << Point(200 + i * 16, 1000 + (i % 2) * 48, 0.5 + (i % 5) / 10.0);
+
+	Brush brush(32, 0.3, 0.5, Qt::darkBlue);
+	brush.setRadius2(1);
+	brush.setSpacing(10);
+	brush.setSubpixel(true);
+	bench("Layer::drawStroke/r=32 soft subpixel", "strokes", 1, [&]() {
+		qreal distance = 0;
+		layer.drawStroke(1, brush, stroke, true, distance);
+	});
+
+	const int threshold = Layer::parallelDabThreshold();
+	Layer::setParallelDabThreshold(INT_MAX);
+	bench("Layer::drawStroke/r=32 soft subpixel, single thread", "strokes", 1, [&]() {
+		qreal distance = 0;
+		layer.drawStroke(1, brush, stroke, true, distance);
+	});
+	Layer::setParallelDabThreshold(threshold);
+}
+
+void benchFill()
+{
+	const QSize size(2048, 2048);
+	Layer layer(0, 1, "", Qt::white, size);
+
+	// Give the layer some pixel data, so not every tile is solid
+	QImage img(1024, 1024, QImage::Format_ARGB32);
+	fillPattern(reinterpret_cast<quint32*>(img.bits()), img.width() * img.height(), 4, true);
+	layer.putImage(0, 0, img, false);
+
+	const QRect rect(10, 10, 2000, 2000);
+	bench("Layer::fillRect/Copy", "pixels", qint64(rect.width()) * rect.height(), [&]() {
+		layer.fillRect(rect, QColor(255, 0, 0, 128), 255);
+	});
+
+	layer.putImage(0, 0, img, false);
+	bench("Layer::fillRect/Multiply", "pixels", qint64(rect.width()) * rect.height(), [&]() {
+		layer.fillRect(rect, QColor(255, 128, 0, 128), 2);
+	});
+}
+
+bool loadBaseline(const QString &filename)
+{
+	QFile f(filename);
+	if(!f.open(QFile::ReadOnly | QFile::Text)) {
+		fprintf(stderr, "Couldn't open %s\n", qPrintable(filename));
+		return false;
+	}
+	QTextStream in(&f);
+	while(!in.atEnd()) {
+		const QString line = in.readLine();
+		const int sep = line.lastIndexOf(' ');
+		if(sep>0)
+			baseline[line.left(sep)] = line.mid(sep+1).toDouble();
+	}
+	return true;
+}
+
+bool saveBaseline(const QString &filename)
+{
+	QFile f(filename);
+	if(!f.open(QFile::WriteOnly | QFile::Text | QFile::Truncate)) {
+		fprintf(stderr, "Couldn't write %s\n", qPrintable(filename));
+		return false;
+	}
+	QTextStream o(&f);
+	for(const QPair<QString, double> &r : results)
+		o << r.first << ' ' << QString::number(r.second, 'f', 0) << '\n';
+	return true;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+	QStringList args = app.arguments();
+	args.removeFirst();
+
+	while(!args.isEmpty()) {
+		const QString arg = args.takeFirst();
+		if(arg == "--list") {
+			foreach(const QString &impl, availableRasteropImplementations())
+				out << impl << endl;
+			return 0;
+		}
+
+		if(arg == "--verify")
+			return verifyCompositing() ? 1 : 0;
+
+		if(args.isEmpty()) {
+			fprintf(stderr, "Unknown option or missing parameter: %s\n", qPrintable(arg));
+			return 1;
+		}
+
+		const QString param = args.takeFirst();
+		if(arg == "--impl") {
+			if(!setRasteropImplementation(param))
+				return 1;
+		} else if(arg == "--filter") {
+			opts.filter = param;
+		} else if(arg == "--time") {
+			opts.mintime = qMax(1, param.toInt());
+		} else if(arg == "--save") {
+			opts.saveFile = param;
+		} else if(arg == "--compare") {
+			opts.compareFile = param;
+		} else {
+			fprintf(stderr, "Unknown option: %s\n", qPrintable(arg));
+			return 1;
+		}
+	}
+
+	if(!opts.compareFile.isEmpty() && !loadBaseline(opts.compareFile))
+		return 1;
+
+	out << "Compositing implementation: " << rasteropImplementation() << endl;
+
+	benchCompositing();
+	benchTiles();
+	benchFlatten();
+	benchDabs();
+	benchFill();
+
+	const TilePool::Stats pool = TilePool::stats();
+	out << QString("Tile pool: %1 live, %2 free, %3 peak, %4 slabs (%5 huge)")
+		.arg(pool.live).arg(pool.free).arg(pool.peak).arg(pool.slabs).arg(pool.hugeSlabs) << endl;
+
+	const Tile::InternStats intern = Tile::internStats();
+	out << QString("Tile sharing: %1 unique, %2 shared references, %3 interned in total")
+		.arg(intern.entries).arg(intern.shared).arg(intern.hits) << endl;
+
+	const BrushMaskGenerator::CacheStats masks = BrushMaskGenerator::cacheStats();
+	out << QString("Brush mask cache: %1 hits, %2 misses, %3 masks (%4 kB)")
+		.arg(masks.hits).arg(masks.misses).arg(masks.masks).arg(masks.kilobytes) << endl;
+
+	if(!opts.saveFile.isEmpty() && !saveBaseline(opts.saveFile))
+		return 1;
+
+	return 0;
+}
@@ -18,6 +18,9 @@
    Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 */
 
+#include <QMutex>
+#include <QCache>
+
 #include <cmath>
 
 #include "brush.h"
@@ -29,26 +32,43 @@ namespace {
 
 template<typename T> T square(T x) { return x*x; }
 
-inline qreal interpolate(qreal a, qreal b, qreal alpha)
-{
-	//return a*alpha + b*(1-alpha);
-	return (a-b) * alpha + b;
-}
-
 typedef quint64 BrushCacheKey;
-static QCache<BrushCacheKey, BrushMaskGenerator> BMG_CACHE(10);
 
 BrushCacheKey brushCacheKey(const Brush &brush) {
-	// the cache key includes only the parameters that affect mask generation
+	// the cache key includes only the parameters that affect mask generation.
+	// The lowest 8 bits are reserved for the pressure level and the highest 8 bits
+	// for the subpixel offset in mask cache keys.
 	return (brush.radius1() << 8) | (brush.radius2() << 16) |
 			(quint64(brush.hardness1()*255) << 24) | (quint64(brush.hardness2()*255) << 32) |
 			(quint64(brush.opacity1()*255) << 40) | (quint64(brush.opacity2()*255) << 48);
 }
 
+// Cache sizes in kilobytes
+static const int GENERATOR_CACHE_SIZE = 8 * 1024;
+static const int MASK_CACHE_SIZE = 32 * 1024;
+
+// Masks for all pressure levels are generated at once if they take less than this
+static const int PREBUILD_LIMIT = 512 * 1024;
+
+// The generator and mask caches are shared by all threads
+QMutex cacheLock;
+QCache<BrushCacheKey, BrushMaskGenerator> generatorCache(GENERATOR_CACHE_SIZE);
+QCache<BrushCacheKey, BrushMask> maskCache(MASK_CACHE_SIZE);
+int cacheHits, cacheMisses;
+
+int kilobytes(int bytes)
+{
+	return 1 + bytes / 1024;
+}
+
 }
 
 static const int PRESSURE_LEVELS = 256;
 
+// Subpixel offsets are rounded to 1/SUBPIXEL_STEPS pixel
+static const int SUBPIXEL_SHIFT = 3;
+static const int SUBPIXEL_STEPS = 1 << SUBPIXEL_SHIFT;
+
 inline float int2pressure(int pressure) {
 	return pressure / float(PRESSURE_LEVELS-1);
 }
@@ -59,23 +79,43 @@ inline int pressure2int(float pressure) {
 	return qBound(0, int(pressure * (PRESSURE_LEVELS-1)), PRESSURE_LEVELS-1);
 }
 
-const BrushMaskGenerator &BrushMaskGenerator::cached(const Brush &brush)
+BrushMaskGenerator BrushMaskGenerator::cached(const Brush &brush)
 {
-	BrushCacheKey key = brushCacheKey(brush);
-	BrushMaskGenerator *bmg = BMG_CACHE[key];
-	if(!bmg) {
-		bmg = new BrushMaskGenerator(brush);
-		BMG_CACHE.insert(key, bmg);
+	const BrushCacheKey key = brushCacheKey(brush);
+	{
+		QMutexLocker lock(&cacheLock);
+		const BrushMaskGenerator *bmg = generatorCache[key];
+		if(bmg)
+			return *bmg;
 	}
-	return *bmg;
+
+	// Generate outside the lock, so other threads are not blocked
+	BrushMaskGenerator bmg(brush);
+	bmg.prebuild();
+
+	QMutexLocker lock(&cacheLock);
+	generatorCache.insert(key, new BrushMaskGenerator(bmg), kilobytes(bmg._lut.size()));
+	return bmg;
+}
+
+BrushMaskGenerator::CacheStats BrushMaskGenerator::cacheStats()
+{
+	QMutexLocker lock(&cacheLock);
+	CacheStats s;
+	s.hits = cacheHits;
+	s.misses = cacheMisses;
+	s.masks = maskCache.count();
+	s.kilobytes = maskCache.totalCost();
+	return s;
 }
 
 BrushMaskGenerator::BrushMaskGenerator()
+	: _key(0), _usepressure(false)
 {
 }
 
 BrushMaskGenerator::BrushMaskGenerator(const Brush &brush)
-	: _cache(10)
+	: _key(brushCacheKey(brush))
 {
 	buildLUT(brush);
 }
@@ -136,28 +176,73 @@ void BrushMaskGenerator::buildLUT(const Brush &brush)
 }
 
 BrushMask BrushMaskGenerator::make(float pressure) const
+{
+	const int p = _usepressure ? pressure2int(pressure) : PRESSURE_LEVELS-1;
+
+	// check cache first
+	{
+		QMutexLocker lock(&cacheLock);
+		const BrushMask *cached = maskCache[_key | p];
+		if(cached) {
+			++cacheHits;
+			return *cached;
+		}
+		++cacheMisses;
+	}
+
+	const BrushMask bm = build(p);
+
+	QMutexLocker lock(&cacheLock);
+	maskCache.insert(_key | p, new BrushMask(bm), kilobytes(square(bm.diameter())));
+	return bm;
+}
+
+/**
+ * Generate masks for all pressure levels at once, if they are small
+ * enough. This avoids generating masks one by one in the middle of a
+ * pressure sensitive stroke.
+ */
+void BrushMaskGenerator::prebuild() const
+{
+	if(!_usepressure)
+		return;
+
+	int bytes = 0;
+	for(int i=0;i<PRESSURE_LEVELS;++i)
+		bytes += square(int(_radius.at(i)*2) + 1);
+
+	if(bytes > PREBUILD_LIMIT)
+		return;
+
+	QVector<BrushMask> masks;
+	masks.reserve(PRESSURE_LEVELS);
+	for(int i=0;i<PRESSURE_LEVELS;++i)
+		masks.append(build(i));
+
+	QMutexLocker lock(&cacheLock);
+	for(int i=0;i<PRESSURE_LEVELS;++i)
+		maskCache.insert(_key | i, new BrushMask(masks.at(i)), kilobytes(square(masks.at(i).diameter())));
+}
+
+/**
+ * @param level pressure level
+ * @return brush mask
+ */
+BrushMask BrushMaskGenerator::build(int level) const
 {
 	float r;
 	int lut_len;
 	const uchar *lut;
-	int p;
 	if(_usepressure) {
-		p = pressure2int(pressure);
-		lut = _lut.data() + _index.at(p);
-		lut_len = _index.at(p+1) - _index.at(p);
-		r = _radius.at(p);
+		lut = _lut.data() + _index.at(level);
+		lut_len = _index.at(level+1) - _index.at(level);
+		r = _radius.at(level);
 	} else {
-		p = 255;
 		lut = _lut.data();
 		lut_len = _index.at(0);
 		r = _radius.at(0);
 	}
 
-	// check cache first
-	BrushMask *cached = _cache[p];
-	if(cached)
-		return *cached;
-
 	const int diameter = int(r*2) + 1;
 
 	QVector<uchar> data;
@@ -172,58 +257,94 @@ BrushMask BrushMaskGenerator::make(float pressure) const
 		}
 	}
 
-	BrushMask *bm = new BrushMask(diameter, data);
-	_cache.insert(p, bm);
-
-	return *bm;
+	return BrushMask(diameter, data);
 }
 
+/**
+ * Generate a brush mask shifted by a subpixel offset.
+ *
+ * The offset is rounded to the nearest 1/SUBPIXEL_STEPS of a pixel, so
+ * there is only a small number of distinct shifted masks per pressure
+ * level. These are cached just like the unshifted masks.
+ *
+ * @param xfrac horizontal offset [0..1]
+ * @param yfrac vertical offset [0..1]
+ * @param pressure brush pressure
+ * @return shifted brush mask
+ */
 BrushMask BrushMaskGenerator::make(float xfrac, float yfrac, float pressure) const
 {
 	Q_ASSERT(xfrac>=0 && xfrac<=1);
 	Q_ASSERT(yfrac>=0 && yfrac<=1);
 
-	const BrushMask mask = make(pressure);
+	const int qx = int(xfrac * SUBPIXEL_STEPS + 0.5f);
+	const int qy = int(yfrac * SUBPIXEL_STEPS + 0.5f);
+
+	// A zero offset is the same as the unshifted mask
+	if(qx==0 && qy==0)
+		return make(pressure);
+
+	const int p = _usepressure ? pressure2int(pressure) : PRESSURE_LEVELS-1;
+	const BrushCacheKey key = _key | p | (BrushCacheKey(qx * (SUBPIXEL_STEPS+1) + qy) << 56);
+
+	{
+		QMutexLocker lock(&cacheLock);
+		const BrushMask *cached = maskCache[key];
+		if(cached) {
+			++cacheHits;
+			return *cached;
+		}
+		++cacheMisses;
+	}
+
+	const BrushMask bm = shift(make(pressure), qx, qy);
+
+	QMutexLocker lock(&cacheLock);
+	maskCache.insert(key, new BrushMask(bm), kilobytes(square(bm.diameter())));
+	return bm;
+}
+
+/**
+ * Resample a mask with a bilinear kernel.
+ *
+ * The kernel weights are integers that add up to SUBPIXEL_STEPS², so
+ * the result is the same on every platform. Pixels outside the source
+ * mask are treated as zero. The inner loop is free of branches and
+ * uses only 16 bit intermediate values, so the compiler can vectorize it.
+ *
+ * @param mask the mask to resample
+ * @param qx horizontal offset in 1/SUBPIXEL_STEPS pixels
+ * @param qy vertical offset in 1/SUBPIXEL_STEPS pixels
+ */
+BrushMask BrushMaskGenerator::shift(const BrushMask &mask, int qx, int qy)
+{
+	static_assert(255 * SUBPIXEL_STEPS * SUBPIXEL_STEPS <= 0xffff, "kernel must fit in 16 bits");
+
 	const int diameter = mask.diameter();
+	const quint16 k0 = qx * qy;
+	const quint16 k1 = (SUBPIXEL_STEPS-qx) * qy;
+	const quint16 k2 = qx * (SUBPIXEL_STEPS-qy);
+	const quint16 k3 = (SUBPIXEL_STEPS-qx) * (SUBPIXEL_STEPS-qy);
+	Q_ASSERT(k0+k1+k2+k3 == SUBPIXEL_STEPS*SUBPIXEL_STEPS);
 
-	const qreal kernel[] = {
-		xfrac*yfrac,
-		(1.0-xfrac)*yfrac,
-		xfrac*(1.0-yfrac),
-		(1.0-xfrac)*(1.0-yfrac)
-	};
-	Q_ASSERT(fabs(kernel[0]+kernel[1]+kernel[2]+kernel[3]-1.0)<0.001);
-	const uchar *src = mask.data();
+	const int bits = 2 * SUBPIXEL_SHIFT;
+	const QVector<uchar> zero(diameter, 0);
 
 	QVector<uchar> data(square(diameter));
 	uchar *ptr = data.data();
 
-#if 0
-	for(int y=-1;y<diameter-1;++y) {
-		const int Y = y*diameter;
-		for(int x=-1;x<diameter-1;++x) {
-			Q_ASSERT(Y+diameter+x+1<diameter*diameter);
-			*(ptr++) =
-				(Y<0?0:(x<0?0:src[Y+x]*kernel[0]) + src[Y+x+1]*kernel[1]) +
-				(x<0?0:src[Y+diameter+x]*kernel[2]) + src[Y+diameter+x+1]*kernel[3];
-		}
-	}
-#else
-	// Unrolled version of the above
-	*(ptr++) = uchar(src[0] * kernel[3]);
-	for(int x=0;x<diameter-1;++x)
-		*(ptr++) = uchar(src[x]*kernel[2] + src[x+1]*kernel[3]);
-	for(int y=0;y<diameter-1;++y) {
-		const int Y = y*diameter;
-		*(ptr++) = uchar(src[Y]*kernel[1] + src[Y+diameter]*kernel[3]);
-		for(int x=0;x<diameter-1;++x)
-			*(ptr++) = uchar(src[Y+x]*kernel[0] + src[Y+x+1]*kernel[1] +
-				src[Y+diameter+x]*kernel[2] + src[Y+diameter+x+1]*kernel[3]);
+	for(int y=0;y<diameter;++y) {
+		const uchar *above = y>0 ? mask.data() + (y-1)*diameter : zero.constData();
+		const uchar *row = mask.data() + y*diameter;
+
+		*(ptr++) = (above[0]*k1 + row[0]*k3) >> bits;
+		for(int x=1;x<diameter;++x)
+			*(ptr++) = quint16(above[x-1]*k0 + above[x]*k1 + row[x-1]*k2 + row[x]*k3) >> bits;
 	}
-#endif
 
 	return BrushMask(diameter, data);
 }
 
 
+
 }
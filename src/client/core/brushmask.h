@@ -21,7 +21,6 @@
 #define PAINTCORE_BRUSHMASK_H
 
 #include <QVector>
-#include <QCache>
 
 #include "brush.h"
 
@@ -55,25 +54,54 @@ private:
 	QVector<uchar> _data;
 };
 
+/**
+ * @brief Brush mask generator
+ *
+ * The generated masks are stored in a global cache shared by all generators.
+ * The cache is keyed on the brush shape parameters and the pressure level,
+ * and limited by the total size of the masks. Generators are cheap to copy
+ * and all functions are thread safe.
+ */
 class BrushMaskGenerator
 {
 public:
+	struct CacheStats {
+		//! Number of masks found in the cache
+		int hits;
+
+		//! Number of masks that had to be generated
+		int misses;
+
+		//! Number of masks currently in the cache
+		int masks;
+
+		//! Total size of the cached masks in kilobytes
+		int kilobytes;
+	};
+
 	BrushMaskGenerator();
 	BrushMaskGenerator(const Brush &brush);
 
-	static const BrushMaskGenerator &cached(const Brush &brush);
+	//! Get a (cached) mask generator for the brush
+	static BrushMaskGenerator cached(const Brush &brush);
 
 	BrushMask make(float pressure) const;
 	BrushMask make(float xfrac, float yfrac, float pressure) const;
 
+	//! Get the mask cache statistics
+	static CacheStats cacheStats();
+
 private:
 	void buildLUT(const Brush &brush);
+	BrushMask build(int level) const;
+	void prebuild() const;
+	static BrushMask shift(const BrushMask &mask, int qx, int qy);
 
+	quint64 _key;
 	QVector<uchar> _lut;
 	QVector<uint> _index;
 	QVector<float> _radius;
 	bool _usepressure;
-	mutable QCache<int, BrushMask> _cache;
 };
 
 }
@@ -0,0 +1,84 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <QAtomicInt>
+
+#include "displaycache.h"
+#include "tile.h"
+
+namespace paintcore {
+
+namespace {
+
+// Maximum size of the display cache in megabytes
+QAtomicInt displayCacheLimit(256);
+
+// Cost of a cached tile in kilobytes
+const int TILE_COST = Tile::BYTES / 1024;
+
+}
+
+DisplayCache::DisplayCache()
+	: _cache(displayCacheLimit.load() * 1024)
+{
+}
+
+QPixmap *DisplayCache::object(int index)
+{
+	return _cache.object(index);
+}
+
+QPixmap DisplayCache::take(int index)
+{
+	QPixmap *p = _cache.take(index);
+	if(!p)
+		return QPixmap();
+
+	QPixmap pixmap = *p;
+	delete p;
+	return pixmap;
+}
+
+void DisplayCache::insert(int index, const QPixmap &pixmap)
+{
+	// Pick up changes to the memory limit
+	const int limit = displayCacheLimit.load() * 1024;
+	if(_cache.maxCost() != limit)
+		_cache.setMaxCost(limit);
+
+	_cache.insert(index, new QPixmap(pixmap), TILE_COST);
+}
+
+void DisplayCache::clear()
+{
+	_cache.clear();
+}
+
+void DisplayCache::setMemoryLimit(int megabytes)
+{
+	displayCacheLimit.store(qMax(1, megabytes));
+}
+
+int DisplayCache::memoryLimit()
+{
+	return displayCacheLimit.load();
+}
+
+}
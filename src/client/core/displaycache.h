@@ -0,0 +1,80 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef PAINTCORE_DISPLAYCACHE_H
+#define PAINTCORE_DISPLAYCACHE_H
+
+#include <QCache>
+#include <QPixmap>
+
+namespace paintcore {
+
+/**
+ * @brief Cache of flattened tiles ready to be drawn on screen
+ *
+ * Only the tiles that have been painted recently are kept. When the
+ * memory limit is reached, the least recently used tiles are dropped
+ * and will be flattened again the next time they are needed.
+ * Memory usage is thus proportional to the viewed area, not the size
+ * of the canvas.
+ *
+ * Pixmaps can only be used in the GUI thread, so this class is not thread safe.
+ */
+class DisplayCache {
+public:
+	DisplayCache();
+
+	/**
+	 * @brief Get a cached tile
+	 *
+	 * The tile is marked as most recently used.
+	 * @return null if the tile is not in the cache
+	 */
+	QPixmap *object(int index);
+
+	/**
+	 * @brief Take a tile out of the cache
+	 *
+	 * The tile can be modified and put back with insert()
+	 * @return null pixmap if the tile is not in the cache
+	 */
+	QPixmap take(int index);
+
+	//! Put a tile into the cache
+	void insert(int index, const QPixmap &pixmap);
+
+	//! Remove all tiles
+	void clear();
+
+	//! Get the memory usage of the cached tiles in kilobytes
+	int usage() const { return _cache.totalCost(); }
+
+	//! Set the maximum memory usage (in megabytes) of display caches
+	static void setMemoryLimit(int megabytes);
+
+	//! Get the maximum memory usage (in megabytes) of display caches
+	static int memoryLimit();
+
+private:
+	QCache<int, QPixmap> _cache;
+};
+
+}
+
+#endif
@@ -0,0 +1,65 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "flattencache.h"
+#include "layer.h"
+#include "tile.h"
+
+namespace paintcore {
+
+/**
+ * The tile content of a hidden layer doesn't matter, so it is not
+ * included in the key. Changing a hidden layer will not invalidate the cache.
+ */
+FlattenCache::LayerKey::LayerKey(const Layer *layer, const Tile &tile, bool sublayers_)
+	: revision(0), id(layer->id()), opacity(layer->effectiveOpacity()),
+	  blend(layer->blendmode()), sublayers(sublayers_)
+{
+	if(opacity>0)
+		revision = tile.revision();
+}
+
+FlattenCache::FlattenCache(int maxKilobytes)
+	: _cache(maxKilobytes)
+{
+}
+
+FlattenCache::Entry *FlattenCache::take(int index)
+{
+	QMutexLocker lock(&_mutex);
+	Entry *e = _cache.take(index);
+	return e ? e : new Entry;
+}
+
+void FlattenCache::insert(int index, Entry *entry)
+{
+	const int cost = 1 + entry->pixels.size() * sizeof(quint32) / 1024;
+
+	QMutexLocker lock(&_mutex);
+	_cache.insert(index, entry, cost);
+}
+
+void FlattenCache::clear()
+{
+	QMutexLocker lock(&_mutex);
+	_cache.clear();
+}
+
+}
@@ -0,0 +1,98 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef PAINTCORE_FLATTENCACHE_H
+#define PAINTCORE_FLATTENCACHE_H
+
+#include <QMutex>
+#include <QCache>
+#include <QVector>
+
+namespace paintcore {
+
+class Layer;
+class Tile;
+
+/**
+ * @brief Cache of partially flattened tiles
+ *
+ * When a layer in the middle of the stack is being drawn on, the
+ * layers below it stay the same. The cache stores the composite of
+ * the unchanged layers at the bottom of the stack, so only the
+ * layers from the one being modified upwards need to be composited again.
+ *
+ * Each entry remembers the state of every layer at its tile (see LayerKey.)
+ * A cached composite is used only if none of the layers it covers has
+ * changed since.
+ *
+ * Entries are taken out of the cache while in use, so different tiles
+ * can be flattened in parallel.
+ */
+class FlattenCache {
+public:
+	//! The state of a layer at a tile
+	struct LayerKey {
+		LayerKey() : revision(0), id(-1), opacity(0), blend(0), sublayers(false) { }
+		LayerKey(const Layer *layer, const Tile &tile, bool sublayers);
+
+		bool operator==(const LayerKey &o) const {
+			return revision == o.revision && id == o.id && opacity == o.opacity
+				&& blend == o.blend && sublayers == o.sublayers;
+		}
+		bool operator!=(const LayerKey &o) const { return !(*this == o); }
+
+		quint64 revision;
+		int id;
+		int opacity; // effective opacity (zero if hidden)
+		int blend;
+		bool sublayers;
+	};
+
+	struct Entry {
+		Entry() : count(0) { }
+
+		//! The state of all layers when the tile was last flattened
+		QVector<LayerKey> keys;
+
+		//! The number of layers (from the bottom) included in the cached pixels
+		int count;
+
+		//! Composite of the bottommost layers
+		QVector<quint32> pixels;
+	};
+
+	explicit FlattenCache(int maxKilobytes);
+
+	//! Take the entry for the given tile out of the cache. Returns a new entry if not found
+	Entry *take(int index);
+
+	//! Put an entry (back) into the cache
+	void insert(int index, Entry *entry);
+
+	//! Remove all entries
+	void clear();
+
+private:
+	QMutex _mutex;
+	QCache<int, Entry> _cache;
+};
+
+}
+
+#endif
@@ -17,11 +17,13 @@
    along with this program; if not, write to the Free Software Foundation,
    Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 */
-#include <QPainter>
 #include <QImage>
 #include <QtConcurrent>
+#include <QAtomicInt>
 #include <QDataStream>
 #include <cmath>
+#include <cstring>
+#include <algorithm>
 
 #include "layerstack.h"
 #include "layer.h"
@@ -34,6 +36,126 @@ namespace paintcore {
 
 namespace {
 
+//! The part of a brush dab that falls on a single tile
+struct TileDab {
+	TileDab() { }
+	TileDab(int dab_, int xt_, int yt_, int xb_, int yb_, int w_, int h_)
+		: dab(dab_), xt(xt_), yt(yt_), xb(xb_), yb(yb_), w(w_), h(h_) { }
+
+	int dab;    // index of the dab
+	int xt, yt; // position in the tile
+	int xb, yb; // position in the brush mask
+	int w, h;   // size of the piece
+};
+
+//! The pieces of dabs to draw on a single tile
+struct TileJob {
+	TileJob() : tile(0) { }
+	TileJob(Tile *t, const QVector<TileDab> &d) : tile(t), dabs(d) { }
+
+	Tile *tile;
+	QVector<TileDab> dabs;
+};
+
+// Minimum number of dabs in a batch to render it in parallel
+QAtomicInt parallelDabs(32);
+
+//! The part of a tile to fill with a color
+struct FillJob {
+	FillJob() : tile(0) { }
+	FillJob(Tile *t, const QRect &r) : tile(t), rect(r) { }
+
+	Tile *tile;
+	QRect rect; // the area to fill (in tile coordinates)
+};
+
+//! The part of an image to put on a single tile
+struct ImageJob {
+	ImageJob() : tile(0) { }
+	ImageJob(Tile *t, const QRect &r) : tile(t), rect(r) { }
+
+	Tile *tile;
+	QRect rect; // the area covered (in layer coordinates)
+};
+
+//! A tile of a resized layer to assemble from the old tiles
+struct ShiftJob {
+	ShiftJob() : index(0) { }
+	ShiftJob(int i, const QRect &s) : index(i), source(s) { }
+
+	int index;    // index of the new tile
+	QRect source; // area of the new tile in old layer coordinates
+	Tile tile;    // the result
+};
+
+/**
+ * @brief Assemble a tile from parts of (at most) four tiles
+ *
+ * @param tiles the source tiles
+ * @param area the area of the source layer
+ * @param src the area to copy (in source layer coordinates)
+ * @param bg the color of pixels outside the source layer
+ */
+Tile shiftedTile(const TileMap &tiles, const QRect &area, const QRect &src, quint32 bg)
+{
+	const QRect r = src & area;
+	Q_ASSERT(!r.isEmpty());
+
+	const int tx0 = r.left() / Tile::SIZE;
+	const int tx1 = r.right() / Tile::SIZE;
+	const int ty0 = r.top() / Tile::SIZE;
+	const int ty1 = r.bottom() / Tile::SIZE;
+
+	// Shortcut: the whole area is covered by identical solid tiles
+	if(r == src) {
+		const Tile &first = tiles.at(tx0, ty0);
+		bool same = first.isSolid();
+		for(int ty=ty0;same && ty<=ty1;++ty)
+			for(int tx=tx0;same && tx<=tx1;++tx)
+				same = tiles.at(tx, ty) == first;
+		if(same)
+			return first;
+	}
+
+	quint32 buf[Tile::LENGTH];
+	std::fill(buf, buf+Tile::LENGTH, bg);
+
+	for(int ty=ty0;ty<=ty1;++ty) {
+		for(int tx=tx0;tx<=tx1;++tx) {
+			const QRect part = r & QRect(tx*Tile::SIZE, ty*Tile::SIZE, Tile::SIZE, Tile::SIZE);
+
+			// Decompress a local copy, so the stored tile stays compressed
+			Tile t = tiles.at(tx, ty);
+			t.decompress();
+
+			quint32 *dest = buf + (part.top()-src.top())*Tile::SIZE + part.left()-src.left();
+			if(t.isSolid()) {
+				const quint32 c = t.solidColor();
+				for(int y=0;y<part.height();++y,dest+=Tile::SIZE)
+					std::fill(dest, dest+part.width(), c);
+			} else {
+				const quint32 *s = t.data() + (part.top()-ty*Tile::SIZE)*Tile::SIZE + part.left()-tx*Tile::SIZE;
+				for(int y=0;y<part.height();++y,dest+=Tile::SIZE,s+=Tile::SIZE)
+					memcpy(dest, s, part.width()*sizeof(quint32));
+			}
+		}
+	}
+
+	Tile tile(QImage(reinterpret_cast<uchar*>(buf), Tile::SIZE, Tile::SIZE, QImage::Format_ARGB32));
+	tile.optimize();
+	return tile;
+}
+
+//! Check if the given area (in layer coordinates) is covered by just the fill tile
+bool onlyFillUnder(const TileMap &tiles, const QRect &rect)
+{
+	for(int ty=rect.top()/Tile::SIZE;ty<=rect.bottom()/Tile::SIZE;++ty)
+		for(int tx=rect.left()/Tile::SIZE;tx<=rect.right()/Tile::SIZE;++tx)
+			if(tiles.at(tx, ty) != tiles.fillTile())
+				return false;
+	return true;
+}
+
 //! Sample colors at layer edges and return the most frequent color
 QColor _sampleEdgeColors(const Layer *layer, bool top, bool right, bool bottom, bool left)
 {
@@ -107,10 +229,8 @@ Layer::Layer(LayerStack *owner, int id, const QString& title, const QColor& colo
 {
 	resize(0, size.width(), size.height(), 0);
 	
-	if(color.alpha() > 0) {
-		for(int i=0;i<_tiles.size();++i)
-			_tiles[i].fillColor(color);
-	}
+	if(color.alpha() > 0)
+		_tiles.fill(Tile(color));
 }
 
 Layer::Layer(LayerStack *owner, int id, const QSize &size)
@@ -123,7 +243,7 @@ Layer::Layer(const Layer &layer)
 	: _owner(layer._owner), id_(layer.id()), _title(layer._title),
 	  _width(layer._width), _height(layer._height),
 	  _xtiles(layer._xtiles), _ytiles(layer._ytiles),
-	  _tiles(layer._tiles),
+	  _tiles(layer._tiles), _content(layer._content),
 	  _opacity(layer._opacity), _blend(layer._blend), _hidden(layer._hidden)
 {
 	// Hidden and ephemeral layers are not copied, since hiding a sublayer is
@@ -155,22 +275,21 @@ void Layer::resize(int top, int right, int bottom, int left)
 
 	int xtiles = Tile::roundTiles(width);
 	int ytiles = Tile::roundTiles(height);
-	QVector<Tile> tiles(xtiles * ytiles);
 
 	// if there is no old content, resizing is simple
-	bool hascontent = false;
-	for(int i=0;i<_tiles.count();++i) {
-		if(!_tiles.at(i).isBlank()) {
-			hascontent = true;
+	bool hascontent = !_tiles.fillTile().isBlank();
+	foreach(int i, _content.indexes()) {
+		if(hascontent)
 			break;
-		}
+		hascontent = !_tiles.at(i).isBlank();
 	}
 	if(!hascontent) {
 		_width = width;
 		_height = height;
 		_xtiles = xtiles;
 		_ytiles = ytiles;
-		_tiles = tiles;
+		_tiles = TileMap(xtiles, ytiles);
+		_content = TileBitmap(xtiles, ytiles);
 		return;
 	}
 
@@ -180,54 +299,73 @@ void Layer::resize(int top, int right, int bottom, int left)
 
 	if((left % Tile::SIZE) || (top % Tile::SIZE)) {
 		// If top/left adjustment is not divisble by tile size,
-		// we need to move the layer content
+		// we need to move the layer content. Each new tile is
+		// assembled from (at most) four old tiles.
+		const QRect oldarea(0, 0, _width, _height);
+		const Tile bgtile = bgcolor.alpha()>0 ? Tile(bgcolor) : Tile();
+		const quint32 bg = bgcolor.alpha()>0 ? bgcolor.rgba() : 0;
+
+		TileMap tiles(xtiles, ytiles);
+		tiles.fill(_tiles.fillTile());
+
+		QVector<ShiftJob> jobs;
+		for(int y=0;y<ytiles;++y) {
+			for(int x=0;x<xtiles;++x) {
+				const QRect src(x*Tile::SIZE - left, y*Tile::SIZE - top, Tile::SIZE, Tile::SIZE);
+
+				if(!src.intersects(oldarea)) {
+					// Completely in the new area
+					if(bgtile != tiles.fillTile())
+						tiles.set(y*xtiles+x, bgtile);
+
+				} else if(!oldarea.contains(src) || !onlyFillUnder(_tiles, src)) {
+					// Partially in the new area or on top of old content.
+					// (Tiles under just the fill tile remain unchanged.)
+					jobs.append(ShiftJob(y*xtiles+x, src));
+				}
+			}
+		}
 
-		QImage oldcontent = toImage();
+		const TileMap oldtiles = _tiles;
+		QtConcurrent::blockingMap(jobs, [&oldtiles, oldarea, bg](ShiftJob &job) {
+			job.tile = shiftedTile(oldtiles, oldarea, job.source, bg);
+		});
+
+		foreach(const ShiftJob &job, jobs) {
+			if(job.tile != tiles.fillTile())
+				tiles.set(job.index, job.tile);
+		}
 
 		_width = width;
 		_height = height;
 		_xtiles = xtiles;
 		_ytiles = ytiles;
 		_tiles = tiles;
-		if(left<0 || top<0) {
-			int cropx = 0;
-			if(left<0) {
-				cropx = -left;
-				left = 0;
-			}
-			int cropy = 0;
-			if(top<0) {
-				cropy = -top;
-				top = 0;
-			}
-			oldcontent = oldcontent.copy(cropx, cropy, oldcontent.width()-cropx, oldcontent.height()-cropy);
-		}
 
-		if(bgcolor.alpha()>0)
-			fillColor(bgcolor);
+		_content = TileBitmap(xtiles, ytiles);
+		foreach(int i, _tiles.indexes())
+			_content.set(i);
 
-		putImage(left, top, oldcontent, false);
+		if(_owner && visible())
+			_owner->markDirty();
 	} else {
 		// top/left offset is aligned at tile boundary:
-		// existing tile content can be reused
-
+		// the tile map's origin is moved, the tiles stay where they are.
 		const int firstrow = Tile::roundTiles(-top);
 		const int firstcol = Tile::roundTiles(-left);
-
-		int oldy = firstrow;
-		for(int y=0;y<ytiles;++y,++oldy) {
-			int oldx = firstcol;
-			const int oldyy = _xtiles * oldy;
-			const int yy = xtiles * y;
-			for(int x=0;x<xtiles;++x,++oldx) {
-				const int i = yy + x;
-
-				if(oldy<0 || oldy>=_ytiles || oldx<0 || oldx>=_xtiles) {
-					if(bgcolor.alpha()>0)
-						tiles[i].fillColor(bgcolor);
-				} else {
-					const int oldi = oldyy + oldx;
-					tiles[i] = _tiles.at(oldi);
+		const QRect oldarea(-firstcol, -firstrow, _xtiles, _ytiles);
+
+		_tiles.resize(firstcol, firstrow, xtiles, ytiles);
+
+		// The new area should be filled with the background color.
+		// Tiles that are not stored individually already have the value
+		// of the fill tile, so in the common case there is nothing to do.
+		const Tile bgtile = bgcolor.alpha()>0 ? Tile(bgcolor) : Tile();
+		if(bgtile != _tiles.fillTile()) {
+			for(int y=0;y<ytiles;++y) {
+				for(int x=0;x<xtiles;++x) {
+					if(!oldarea.contains(x, y))
+						_tiles.set(y*xtiles+x, bgtile);
 				}
 			}
 		}
@@ -236,10 +374,25 @@ void Layer::resize(int top, int right, int bottom, int left)
 		_height = height;
 		_xtiles = xtiles;
 		_ytiles = ytiles;
-		_tiles = tiles;
+
+		_content = TileBitmap(xtiles, ytiles);
+		foreach(int i, _tiles.indexes())
+			_content.set(i);
 	}
 }
 
+QRect Layer::contentBounds() const
+{
+	if(!_tiles.fillTile().isNull())
+		return QRect(0, 0, _width, _height);
+
+	const QRect &b = _content.bounds();
+	if(b.isEmpty())
+		return QRect();
+	return QRect(b.x() * Tile::SIZE, b.y() * Tile::SIZE, b.width() * Tile::SIZE, b.height() * Tile::SIZE)
+		.intersected(QRect(0, 0, _width, _height));
+}
+
 void Layer::setTitle(const QString& title)
 {
 	_title = title;
@@ -250,7 +403,7 @@ QImage Layer::toImage() const {
 	int i=0;
 	for(int y=0;y<_ytiles;++y) {
 		for(int x=0;x<_xtiles;++x,++i)
-			_tiles[i].copyToImage(image, x*Tile::SIZE, y*Tile::SIZE);
+			_tiles.at(i).copyToImage(image, x*Tile::SIZE, y*Tile::SIZE);
 	}
 	return image;
 }
@@ -258,14 +411,40 @@ QImage Layer::toImage() const {
 /**
  * @param x
  * @param y
+ * @param dia diameter of the sampled area. If greater than one,
+ *            the average color of the area centered at x,y is returned
  * @return invalid color if x or y is outside image boundaries
  */
-QColor Layer::colorAt(int x, int y) const
+QColor Layer::colorAt(int x, int y, int dia) const
 {
-	if(x<0 || y<0 || x>=_width || y>=_height)
+	if(dia <= 1) {
+		if(x<0 || y<0 || x>=_width || y>=_height)
+			return QColor();
+
+		return QColor::fromRgb(pixelAt(x, y));
+	}
+
+	const QRect area = QRect(x - dia/2, y - dia/2, dia, dia) & QRect(0, 0, _width, _height);
+	if(area.isEmpty())
 		return QColor();
 
-	return QColor::fromRgb(pixelAt(x, y));
+	// Average of the sampled pixels, weighted by alpha
+	quint64 r=0, g=0, b=0, a=0;
+	for(int py=area.top();py<=area.bottom();++py) {
+		for(int px=area.left();px<=area.right();++px) {
+			const quint32 c = pixelAt(px, py);
+			r += qRed(c) * qAlpha(c);
+			g += qGreen(c) * qAlpha(c);
+			b += qBlue(c) * qAlpha(c);
+			a += qAlpha(c);
+		}
+	}
+
+	if(a == 0)
+		return QColor(0, 0, 0, 0);
+
+	const int n = area.width() * area.height();
+	return QColor((r + a/2) / a, (g + a/2) / a, (b + a/2) / a, (a + n/2) / n);
 }
 
 QRgb Layer::pixelAt(int x, int y) const
@@ -285,7 +464,10 @@ QRgb Layer::pixelAt(int x, int y) const
 void Layer::setOpacity(int opacity)
 {
 	Q_ASSERT(opacity>=0 && opacity<256);
+	const bool wasVisible = visible();
 	_opacity = opacity;
+	if(!wasVisible && visible())
+		decompressTiles();
 	markOpaqueDirty(true);
 }
 
@@ -300,56 +482,24 @@ void Layer::setBlend(int blend)
  */
 void Layer::setHidden(bool hide)
 {
+	const bool wasVisible = visible();
 	_hidden = hide;
+	if(!wasVisible && visible())
+		decompressTiles();
 	markOpaqueDirty(true);
 }
 
-/**
- * Return a copy of the image with the borders padded to align with tile boundaries.
- * The padding pixels are taken from the layer content, so the image can be used
- * to replace the existing tiles.
- * @param xpos target image position
- * @param ypos target image position
- * @param original the image to pad
- * @param alpha alpha blend image
- */
-QImage Layer::padImageToTileBoundary(int xpos, int ypos, const QImage &original, bool alpha) const
+void Layer::decompressTiles()
 {
-	const int x0 = Tile::roundDown(xpos);
-	const int x1 = qMin(_width, Tile::roundUp(xpos+original.width()));
-	const int y0 = Tile::roundDown(ypos);
-	const int y1 = qMin(_height, Tile::roundUp(ypos+original.height()));
-
-	const int w = x1 - x0;
-	const int h = y1 - y0;
-	
-	QImage image(w, h, QImage::Format_ARGB32);
-	//image.fill(0);
-
-	// Copy background from existing tiles
-	for(int y=0;y<h;y+=Tile::SIZE) {
-		//int yt = (y0 + y) / Tile::SIZE;
-		for(int x=0;x<w;x+=Tile::SIZE) {
-			const Tile &t = tile((x0+x) / Tile::SIZE, (y0+y) / Tile::SIZE);
-			t.copyToImage(image, x, y);
-		}
+	// Only the compressed tiles are touched, so the tile storage
+	// stays shared with the savepoints if there is nothing to do.
+	foreach(int i, _tiles.indexes()) {
+		if(_tiles.at(i).isCompressed())
+			_tiles.ref(i).decompress();
 	}
-	
-	// Paint new image
-	QPainter painter(&image);
-	if(!alpha)
-		painter.setCompositionMode(QPainter::CompositionMode_Source);
-	painter.drawImage(xpos-x0, ypos-y0, original);
-	
-#if 0 /* debugging aid */
-	painter.setPen(Qt::red);
-	painter.drawLine(0, 0, w-1, 0);
-	painter.drawLine(0, 0, 0, h-1);
-	painter.drawLine(w-1, 0, w-1, h-1);
-	painter.drawLine(0, h-1, w-1, h-1);
-#endif
-	
-	return image;
+
+	foreach(Layer *sl, _sublayers)
+		sl->decompressTiles();
 }
 
 /**
@@ -367,35 +517,56 @@ void Layer::putImage(int x, int y, QImage image, bool blend)
 	Q_ASSERT(x>=0 && y>=0);
 	if(x<0 || y<0)
 		return;
-	
+
+	const QRect area = QRect(x, y, image.width(), image.height()) & QRect(0, 0, _width, _height);
+
 	// Check if the image is completely outside the layer
-	if(x >= _width || y >= _height)
+	if(area.isEmpty())
 		return;
 
-	const int x0 = Tile::roundDown(x);
-	const int y0 = Tile::roundDown(y);
-	
-	if(x-x0 || y-y0 || image.width() % Tile::SIZE || image.height() % Tile::SIZE || blend) {
-		image = padImageToTileBoundary(x, y, image, blend);
-	}
-	
-	const int tx0 = x0 / Tile::SIZE;
-	const int ty0 = y0 / Tile::SIZE;
-	const int tx1 = qMin((x0 + image.width() - 1) / Tile::SIZE, _xtiles-1);
-	const int ty1 = qMin((y0 + image.height() - 1) / Tile::SIZE, _ytiles-1);
+	const int tx0 = area.left() / Tile::SIZE;
+	const int tx1 = area.right() / Tile::SIZE;
+	const int ty0 = area.top() / Tile::SIZE;
+	const int ty1 = area.bottom() / Tile::SIZE;
 
+	// Look up the target tiles first. The tile map must not be
+	// modified while the tiles are being drawn on.
+	_tiles.detach();
+	QVector<ImageJob> jobs;
+	jobs.reserve((tx1-tx0+1) * (ty1-ty0+1));
 	for(int ty=ty0;ty<=ty1;++ty) {
-		int yoff = (ty-ty0) * Tile::SIZE;
 		for(int tx=tx0;tx<=tx1;++tx) {
-			int xoff = (tx-tx0) * Tile::SIZE;
-			int i = ty*_xtiles + tx;
-			Q_ASSERT(i>=0 && i < _xtiles*_ytiles);
-			_tiles[i] = Tile(image, xoff, yoff);
+			const QRect tilerect(tx*Tile::SIZE, ty*Tile::SIZE, Tile::SIZE, Tile::SIZE);
+			jobs.append(ImageJob(&_tiles.ref(ty*_xtiles + tx), tilerect & area));
 		}
 	}
-	
+
+	// Each tile gets its own part of the image, so they can be processed in parallel
+	auto putTile = [&image, x, y, blend](const ImageJob &job) {
+		const int xoff = job.rect.x() - x;
+		const int yoff = job.rect.y() - y;
+		if(!blend && job.rect.width() == Tile::SIZE && job.rect.height() == Tile::SIZE) {
+			// Tile is completely replaced
+			Tile t(image, xoff, yoff);
+			t.intern();
+			*job.tile = t;
+		} else {
+			const QRect r(job.rect.x() % Tile::SIZE, job.rect.y() % Tile::SIZE, job.rect.width(), job.rect.height());
+			job.tile->putImage(image, xoff, yoff, r, blend);
+		}
+	};
+
+	if(jobs.size() > 1) {
+		QtConcurrent::blockingMap(jobs, putTile);
+	} else {
+		foreach(const ImageJob &job, jobs)
+			putTile(job);
+	}
+
+	_content.set(QRect(QPoint(tx0, ty0), QPoint(tx1, ty1)));
+
 	if(_owner && visible()) {
-		_owner->markDirty(QRect(x, y, image.width(), image.height()));
+		_owner->markDirty(area);
 		_owner->notifyAreaChanged();
 	}
 }
@@ -411,33 +582,62 @@ void Layer::fillRect(const QRect &rectangle, const QColor &color, int blendmode)
 	}
 
 	QRect rect = rectangle.intersected(canvas);
+	if(rect.isEmpty())
+		return;
 
-	uchar mask[Tile::LENGTH];
-	if(blendmode==255)
-		memset(mask, 0xff, Tile::LENGTH);
-	else
-		memset(mask, color.alpha(), Tile::LENGTH);
+	// The copy mode ignores the color's alpha, since it is copied as is
+	const uchar alpha = blendmode==255 ? 255 : color.alpha();
 
-	const int size = Tile::SIZE;
-	const int bottom = rect.y() + rect.height();
-	const int right = rect.x() + rect.width();
+	const int tx0 = rect.x() / Tile::SIZE;
+	const int tx1 = rect.right() / Tile::SIZE;
+	const int ty0 = rect.y() / Tile::SIZE;
+	const int ty1 = rect.bottom() / Tile::SIZE;
 
-	const int tx0 = rect.x() / size;
-	const int tx1 = right / size;
-	const int ty0 = rect.y() / size;
-	const int ty1 = bottom / size;
+	// Fully covered tiles that currently have the value of the fill tile
+	// all get the same result, so it only needs to be calculated once.
+	Tile filledFill = _tiles.fillTile();
+	bool filledFillDone = false;
 
+	// Look up the target tiles first. The tile map must not be
+	// modified while the tiles are being drawn on.
+	_tiles.detach();
+	QVector<FillJob> jobs;
 	for(int ty=ty0;ty<=ty1;++ty) {
 		for(int tx=tx0;tx<=tx1;++tx) {
-			int left = qMax(tx * size, rect.x()) - tx*size;
-			int top = qMax(ty * size, rect.y()) - ty*size;
-			int w = qMin((tx+1)*size, right) - tx*size - left;
-			int h = qMin((ty+1)*size, bottom) - ty*size - top;
+			const int i = ty*_xtiles + tx;
+			const QRect tilerect(tx*Tile::SIZE, ty*Tile::SIZE, Tile::SIZE, Tile::SIZE);
+			const QRect r = (rect & tilerect).translated(-tilerect.topLeft());
+
+			if(r.width() == Tile::SIZE && r.height() == Tile::SIZE
+					&& (blendmode==255 || _tiles.at(i) == _tiles.fillTile())) {
+				// Fully covered tile whose result is uniform
+				if(!filledFillDone) {
+					if(blendmode==255)
+						filledFill = Tile();
+					filledFill.compositeColor(blendmode, color, alpha, r);
+					filledFillDone = true;
+				}
+				if(filledFill == _tiles.fillTile())
+					_tiles.remove(i);
+				else
+					_tiles.set(i, filledFill);
+			} else {
+				jobs.append(FillJob(&_tiles.ref(i), r));
+			}
+			_content.set(i);
+		}
+	}
 
-			Tile &t = _tiles[ty*_xtiles+tx];
+	// Tiles are independent of each other, so they can be filled in parallel
+	auto fillTile = [&color, blendmode, alpha](const FillJob &job) {
+		job.tile->compositeColor(blendmode, color, alpha, job.rect);
+	};
 
-			t.composite(blendmode, mask, color, left, top, w, h, 0);
-		}
+	if(jobs.size() > 1) {
+		QtConcurrent::blockingMap(jobs, fillTile);
+	} else {
+		foreach(const FillJob &job, jobs)
+			fillTile(job);
 	}
 
 	if(_owner && visible()) {
@@ -448,36 +648,35 @@ void Layer::fillRect(const QRect &rectangle, const QColor &color, int blendmode)
 
 void Layer::dab(int contextId, const Brush &brush, const Point &point)
 {
-	Brush effective_brush = brush;
-	Layer *l = this;
-
-	if(!brush.incremental()) {
-		// Indirect brush: use a sublayer
-		l = getSubLayer(contextId, brush.blendingMode(), brush.opacity(1) * 255);
-
-		effective_brush.setOpacity(1.0);
-		effective_brush.setOpacity2(brush.isOpacityVariable() ? 0.0 : 1.0);
-		effective_brush.setBlendingMode(1);
-
-	} else if(contextId<0) {
-		// Special case: negative context IDs are temporary overlay strokes
-		l = getSubLayer(contextId, brush.blendingMode(), 255);
-		effective_brush.setBlendingMode(1);
-	}
-
-	l->directDab(effective_brush, BrushMaskGenerator::cached(effective_brush), point);
-
-	if(_owner)
-		_owner->notifyAreaChanged();
+	qreal distance = 0;
+	drawStroke(contextId, brush, PointVector() << point, true, distance);
 }
 
 /**
- * Draw a line using either drawSoftLine or drawHardLine, depending on
+ * Draw a line using either drawHardLine or drawSoftLine, depending on
  * the subpixel hint of the brush.
  * @param context drawing context id (needed for indirect drawing)
  */
 void Layer::drawLine(int contextId, const Brush& brush, const Point& from, const Point& to, qreal &distance)
 {
+	drawStroke(contextId, brush, PointVector() << from << to, false, distance);
+}
+
+/**
+ * Draw lines through all the given points. The dab positions are
+ * calculated first and then rendered in one batch, one tile at a time.
+ *
+ * @param context drawing context id (needed for indirect drawing)
+ * @param brush brush to draw with
+ * @param points the points to connect
+ * @param dabFirst start a new stroke with a dab at the first point
+ * @param distance distance from previous dab
+ */
+void Layer::drawStroke(int contextId, const Brush& brush, const PointVector &points, bool dabFirst, qreal &distance)
+{
+	if(points.isEmpty())
+		return;
+
 	Brush effective_brush = brush;
 	Layer *l = this;
 
@@ -495,12 +694,19 @@ void Layer::drawLine(int contextId, const Brush& brush, const Point& from, const
 		effective_brush.setBlendingMode(1);
 	}
 
-	const BrushMaskGenerator &bmg = BrushMaskGenerator::cached(effective_brush);
+	PointVector dabs;
+	if(dabFirst)
+		dabs.append(points.first());
 
-	if(effective_brush.subpixel())
-		l->drawSoftLine(effective_brush, bmg, from, to, distance);
-	else
-		l->drawHardLine(effective_brush, bmg, from, to, distance);
+	for(int i=1;i<points.size();++i) {
+		if(effective_brush.subpixel())
+			drawSoftLine(effective_brush, points.at(i-1), points.at(i), distance, dabs);
+		else
+			drawHardLine(effective_brush, points.at(i-1), points.at(i), distance, dabs);
+	}
+
+	if(!dabs.isEmpty())
+		l->drawDabs(effective_brush, BrushMaskGenerator::cached(effective_brush), dabs);
 
 	if(_owner)
 		_owner->notifyAreaChanged();
@@ -512,8 +718,9 @@ void Layer::drawLine(int contextId, const Brush& brush, const Point& from, const
  * @param from starting point
  * @param to ending point
  * @param distance distance from previous dab.
+ * @param dabs dab positions are appended here
  */
-void Layer::drawSoftLine(const Brush& brush, const BrushMaskGenerator &mask, const Point& from, const Point& to, qreal &distance)
+void Layer::drawSoftLine(const Brush& brush, const Point& from, const Point& to, qreal &distance, PointVector &dabs)
 {
 	const qreal spacing = qMax(1.0, brush.spacing()*brush.radius(from.pressure())/100.0);
 	qreal dx = to.x() - from.x();
@@ -534,7 +741,7 @@ void Layer::drawSoftLine(const Brush& brush, const BrushMaskGenerator &mask, con
 	Point p(from.x() + dx*i, from.y() + dy*i, qBound(0.0, from.pressure() + dp*i, 1.0));
 
 	for(;i<=dist;i+=spacing) {
-		directDab(brush, mask, p);
+		dabs.append(p);
 		p.rx() += dx * spacing;
 		p.ry() += dy * spacing;
 		p.setPressure(qBound(0.0, p.pressure() + dp * spacing, 1.0));
@@ -547,7 +754,7 @@ void Layer::drawSoftLine(const Brush& brush, const BrushMaskGenerator &mask, con
  * precision.
  * The last point is not drawn, so successive lines can be drawn blotches.
  */
-void Layer::drawHardLine(const Brush &brush, const BrushMaskGenerator& mask, const Point& from, const Point& to, qreal &distance) {
+void Layer::drawHardLine(const Brush &brush, const Point& from, const Point& to, qreal &distance, PointVector &dabs) {
 	const qreal dp = (to.pressure()-from.pressure()) / hypot(to.x()-from.x(), to.y()-from.y());
 
 	const int spacing = brush.spacing()*brush.radius(from.pressure())/100;
@@ -587,7 +794,7 @@ void Layer::drawHardLine(const Brush &brush, const BrushMaskGenerator& mask, con
 			x0 += stepx;
 			fraction += dy;
 			if(++distance > spacing) {
-				directDab(brush, mask, Point(x0, y0, p));
+				dabs.append(Point(x0, y0, p));
 				distance = 0;
 			}
 			p += dp;
@@ -602,7 +809,7 @@ void Layer::drawHardLine(const Brush &brush, const BrushMaskGenerator& mask, con
 			y0 += stepy;
 			fraction += dx;
 			if(++distance > spacing) {
-				directDab(brush, mask, Point(x0, y0, p));
+				dabs.append(Point(x0, y0, p));
 				distance = 0;
 			}
 			p += dp;
@@ -611,71 +818,132 @@ void Layer::drawHardLine(const Brush &brush, const BrushMaskGenerator& mask, con
 }
 
 /**
- * Apply a single dab of the brush to the layer
+ * Apply a series of brush dabs to the layer.
+ *
+ * A single dab can (and often does) span multiple tiles. Rather than
+ * compositing each dab onto all the tiles it touches in turn, the dabs
+ * are first split into per tile pieces. Each tile is then processed
+ * in one go. Within a tile, the dabs are composited in their original
+ * order, so the result is the same as when drawing one dab at a time.
+ *
  * @param brush brush to use
- * @parma point where to dab. May be outside the image.
+ * @param mask mask generator for the brush
+ * @param dabs where to dab. Points may be outside the image.
  */
-void Layer::directDab(const Brush &brush, const BrushMaskGenerator& mask, const Point& point)
-{
-	const int dia = brush.diameter(point.pressure())+1; // space for subpixels
-	const float fradius = brush.fradius(point.pressure());
-	const float fx = point.x() - fradius;
-	const float fy = point.y() - fradius;
-	const int top = floor(fy);
-	const int left = floor(fx);
-	const int bottom = qMin(top + dia, _height);
-	const int right = qMin(left + dia, _width);
-	if(left+dia<=0 || top+dia<=0 || left>=_width || top>=_height)
-		return;
+void Layer::drawDabs(const Brush &brush, const BrushMaskGenerator& mask, const PointVector &dabs)
+{
+	QVector<BrushMask> masks;
+	QVector<QColor> colors;
+	QHash<int, QVector<TileDab>> bins;
+	masks.reserve(dabs.size());
+	colors.reserve(dabs.size());
+
+	foreach(const Point &point, dabs) {
+		const int dia = brush.diameter(point.pressure())+1; // space for subpixels
+		const float fradius = brush.fradius(point.pressure());
+		const float fx = point.x() - fradius;
+		const float fy = point.y() - fradius;
+		const int top = floor(fy);
+		const int left = floor(fx);
+		const int bottom = qMin(top + dia, _height);
+		const int right = qMin(left + dia, _width);
+		if(left+dia<=0 || top+dia<=0 || left>=_width || top>=_height)
+			continue;
+
+		// Render the brush
+		BrushMask bm;
+		if(brush.subpixel()) {
+			float xfrac = fx - left;
+			float yfrac = fy - top;
+			bm = mask.make(xfrac, yfrac, point.pressure());
+		} else
+			bm = mask.make(point.pressure());
+
+		const int dab = masks.size();
+		const int realdia = bm.diameter();
+		masks.append(bm);
+		colors.append(brush.color(point.pressure()));
+
+		// Split the dab into tile sized pieces
+		int y = top<0?0:top;
+		int yb = top<0?-top:0; // y in relation to brush origin
+		const int x0 = left<0?0:left;
+		const int xb0 = left<0?-left:0;
+		while(y<bottom) {
+			const int yindex = y / Tile::SIZE;
+			const int yt = y - yindex * Tile::SIZE;
+			const int hb = yt+realdia-yb < Tile::SIZE ? realdia-yb : Tile::SIZE-yt;
+			int x = x0;
+			int xb = xb0; // x in relation to brush origin
+			while(x<right) {
+				const int xindex = x / Tile::SIZE;
+				const int xt = x - xindex * Tile::SIZE;
+				const int wb = xt+realdia-xb < Tile::SIZE ? realdia-xb : Tile::SIZE-xt;
+
+				bins[_xtiles * yindex + xindex].append(TileDab(dab, xt, yt, xb, yb, wb, hb));
+
+				x = (xindex+1) * Tile::SIZE;
+				xb = xb + wb;
+			}
+			y = (yindex+1) * Tile::SIZE;
+			yb = yb + hb;
+		}
 
-	// Render the brush
-	BrushMask bm;
-	if(brush.subpixel()) {
-		float xfrac = fx - left;
-		float yfrac = fy - top;
-		bm = mask.make(xfrac, yfrac, point.pressure());
-	} else
-		bm = mask.make(point.pressure());
-
-	const int realdia = bm.diameter();
-	const uchar *values = bm.data();
-	QColor color = brush.color(point.pressure());
-
-	// A single dab can (and often does) span multiple tiles.
-	int y = top<0?0:top;
-	int yb = top<0?-top:0; // y in relation to brush origin
-	const int x0 = left<0?0:left;
-	const int xb0 = left<0?-left:0;
-	while(y<bottom) {
-		const int yindex = y / Tile::SIZE;
-		const int yt = y - yindex * Tile::SIZE;
-		const int hb = yt+realdia-yb < Tile::SIZE ? realdia-yb : Tile::SIZE-yt;
-		int x = x0;
-		int xb = xb0; // x in relation to brush origin
-		while(x<right) {
-			const int xindex = x / Tile::SIZE;
-			const int xt = x - xindex * Tile::SIZE;
-			const int wb = xt+realdia-xb < Tile::SIZE ? realdia-xb : Tile::SIZE-xt;
-			const int i = _xtiles * yindex + xindex;
-			_tiles[i].composite(
-					brush.blendingMode(),
-					values + yb * realdia + xb,
-					color,
-					xt, yt,
-					wb, hb,
-					realdia-wb
-					);
+		if(_owner && visible())
+			_owner->markDirty(QRect(left, top, right-left, bottom-top));
+	}
 
-			x = (xindex+1) * Tile::SIZE;
-			xb = xb + wb;
+	// Look up the target tiles first. The tile map must not be
+	// modified while the tiles are being drawn on.
+	_tiles.detach();
+	QVector<TileJob> jobs;
+	jobs.reserve(bins.size());
+	QHashIterator<int, QVector<TileDab>> bin(bins);
+	while(bin.hasNext()) {
+		bin.next();
+		jobs.append(TileJob(&_tiles.ref(bin.key()), bin.value()));
+		_content.set(bin.key());
+	}
+
+	// Tiles are independent of each other, so they can be processed
+	// in any order, or in parallel. The result is the same either way.
+	const int blendmode = brush.blendingMode();
+	auto compositeTile = [&masks, &colors, blendmode](const TileJob &job) {
+		foreach(const TileDab &td, job.dabs) {
+			const BrushMask &bm = masks.at(td.dab);
+			job.tile->composite(
+					blendmode,
+					bm.data() + td.yb * bm.diameter() + td.xb,
+					colors.at(td.dab),
+					td.xt, td.yt,
+					td.w, td.h,
+					bm.diameter()-td.w
+					);
 		}
-		y = (yindex+1) * Tile::SIZE;
-		yb = yb + hb;
+	};
+
+	if(jobs.size() > 1 && masks.size() >= parallelDabs.load()) {
+		QtConcurrent::blockingMap(jobs, compositeTile);
+	} else {
+		foreach(const TileJob &job, jobs)
+			compositeTile(job);
 	}
+}
 
-	if(_owner && visible())
-		_owner->markDirty(QRect(left, top, right-left, bottom-top));
+/**
+ * Strokes with fewer dabs than this are rendered in a single thread,
+ * since starting the worker threads would take longer than the rendering.
+ *
+ * @param dabs minimum number of dabs
+ */
+void Layer::setParallelDabThreshold(int dabs)
+{
+	parallelDabs.store(qMax(1, dabs));
+}
 
+int Layer::parallelDabThreshold()
+{
+	return parallelDabs.load();
 }
 
 /**
@@ -687,37 +955,53 @@ void Layer::merge(const Layer *layer, bool sublayers)
 	Q_ASSERT(layer->_xtiles == _xtiles);
 	Q_ASSERT(layer->_ytiles == _ytiles);
 
-	// Gather a list of non-null tiles to merge
-	QVector<int> mergeidx;
-	mergeidx.reserve(_tiles.size());
-	for(int i=0;i<_tiles.size();++i) {
-		bool isnull = layer->_tiles[i].isNull();
-
-		if(isnull && sublayers) {
-			foreach(Layer *sl, _sublayers) {
-				if(sl->_tiles[i].isNull()) {
-					isnull = false;
-					break;
-				}
+	// Gather a list of tiles to merge. Tiles that are null in the
+	// source layer (and its sublayers) would not change anything.
+	// Non-null fill tiles are merged separately, so only the tiles
+	// stored in either layer need to be merged individually.
+	TileBitmap source = layer->_content;
+	bool mergeFill = !layer->_tiles.fillTile().isNull();
+	if(sublayers) {
+		foreach(const Layer *sl, layer->_sublayers) {
+			if(sl->visible()) {
+				source.unite(sl->_content);
+				mergeFill |= !sl->_tiles.fillTile().isNull();
 			}
 		}
-
-		if(!isnull)
-			mergeidx.append(i);
 	}
+	if(mergeFill)
+		source.unite(_content);
+	_content.unite(source);
 
-	// Detach tile vector explicitly to make sure concurrent modifications
-	// are all done to the same vector
+	// Look up the target tiles first, since the tile map must not be
+	// modified by the worker threads.
 	_tiles.detach();
+	QVector<QPair<int, Tile*>> targets;
+	foreach(int idx, source.indexes())
+		targets.append(qMakePair(idx, &_tiles.ref(idx)));
+
+	// The rest of the tiles are equal to the fill tile in both layers
+	if(mergeFill) {
+		Tile fill = _tiles.fillTile();
+		fill.merge(layer->_tiles.fillTile(), layer->_opacity, layer->blendmode());
+		if(sublayers) {
+			foreach(const Layer *sl, layer->_sublayers) {
+				if(sl->visible())
+					fill.merge(sl->_tiles.fillTile(), sl->_opacity, sl->blendmode());
+			}
+		}
+		_tiles.setFillTile(fill);
+	}
 
 	// Merge tiles
-	QtConcurrent::blockingMap(mergeidx, [this, layer, sublayers](int idx) {
-		_tiles[idx].merge(layer->_tiles[idx], layer->_opacity, layer->blendmode());
+	QtConcurrent::blockingMap(targets, [layer, sublayers](const QPair<int, Tile*> &target) {
+		const int idx = target.first;
+		target.second->merge(layer->_tiles.at(idx), layer->_opacity, layer->blendmode());
 
 		if(sublayers) {
 			foreach(Layer *sl, layer->_sublayers) {
 				if(sl->visible()) {
-					_tiles[idx].merge(sl->_tiles[idx], sl->_opacity, sl->blendmode());
+					target.second->merge(sl->_tiles.at(idx), sl->_opacity, sl->blendmode());
 				}
 			}
 		}
@@ -729,21 +1013,34 @@ void Layer::merge(const Layer *layer, bool sublayers)
 
 void Layer::fillColor(const QColor& color)
 {
-	for(int i=0;i<_tiles.size();++i)
-		_tiles[i].fillColor(color);
+	_tiles.fill(Tile(color));
+	_content.clearAll();
 
 	if(_owner && visible())
 		_owner->markDirty();
 }
 
 /**
- * Free all tiles that are completely transparent
+ * Free all tiles that are completely transparent or identical
+ * to the fill tile.
  */
 void Layer::optimize()
 {
 	// Optimize tile memory usage
-	for(int i=0;i<_tiles.size();++i)
-		_tiles[i].optimize();
+	// The tiles are optimized through a copy, so the tile storage
+	// is detached only if something actually changes.
+	foreach(int i, _tiles.indexes()) {
+		Tile t = _tiles.at(i);
+		t.optimize();
+		if(t == _tiles.fillTile())
+			_tiles.remove(i);
+		else if(t != _tiles.at(i))
+			_tiles.set(i, t);
+
+		if(_tiles.at(i) == _tiles.fillTile())
+			_content.clear(i);
+	}
+	_content.shrink();
 
 	// Delete unused sublayers
 	QMutableListIterator<Layer*> li(_sublayers);
@@ -758,8 +1055,8 @@ void Layer::optimize()
 
 void Layer::makeBlank()
 {
-	for(int i=0;i<_tiles.size();++i)
-		_tiles[i].makeBlank();
+	_tiles.fill(Tile());
+	_content.clearAll();
 
 	if(_owner && visible())
 		_owner->markDirty();
@@ -855,9 +1152,14 @@ void Layer::markOpaqueDirty(bool forceVisible)
 	if(!_owner || !(forceVisible || visible()))
 		return;
 
-	for(int i=0;i<_xtiles*_ytiles;++i) {
-		if(!_tiles.at(i).isNull())
-			_owner->markDirty(i);
+	if(!_tiles.fillTile().isNull()) {
+		// Every tile of the layer has content
+		_owner->markDirty();
+	} else {
+		foreach(int i, _content.indexes()) {
+			if(!_tiles.at(i).isNull())
+				_owner->markDirty(i);
+		}
 	}
 	_owner->notifyAreaChanged();
 }
@@ -23,6 +23,9 @@
 #include <QColor>
 
 #include "tile.h"
+#include "point.h"
+#include "tilebitmap.h"
+#include "tilemap.h"
 
 class QImage;
 class QSize;
@@ -32,7 +35,6 @@ namespace paintcore {
 
 class Brush;
 class BrushMaskGenerator;
-class Point;
 class Tile;
 class LayerStack;
 
@@ -44,6 +46,7 @@ class LayerStack;
  * always a multiple of Tile::SIZE.
  */
 class Layer {
+	friend class TileCompressor;
 	public:
 		//! Construct a layer filled with solid color
 		Layer(LayerStack *owner, int id, const QString& title, const QColor& color, const QSize& size);
@@ -74,8 +77,8 @@ class Layer {
 		//! Adjust layer size
 		void resize(int top, int right, int bottom, int left);
 
-		//! Get the color at the specified coordinates
-		QColor colorAt(int x, int y) const;
+		//! Get the color at the specified coordinates (or the average color around them)
+		QColor colorAt(int x, int y, int dia=1) const;
 
 		//! Get the raw pixel value at the specified coordinates
 		QRgb pixelAt(int x, int y) const;
@@ -125,6 +128,9 @@ class Layer {
 		//! Draw a line using either drawHardLine or drawSoftLine
 		void drawLine(int contextId, const Brush& brush, const Point& from, const Point& to, qreal &distance);
 
+		//! Draw a series of connected lines in one batch
+		void drawStroke(int contextId, const Brush& brush, const PointVector &points, bool dabFirst, qreal &distance);
+
 		//! Merge a sublayer with this layer
 		void mergeSublayer(int id);
 
@@ -144,11 +150,26 @@ class Layer {
 		const Tile &tile(int x, int y) const {
 			Q_ASSERT(x>=0 && x<_xtiles);
 			Q_ASSERT(y>=0 && y<_ytiles);
-			return _tiles[y*_xtiles+x];
+			return _tiles.at(x, y);
 		}
 
 		//! Get a tile
-		const Tile &tile(int index) const { Q_ASSERT(index>=0 && index<_xtiles*_ytiles); return _tiles[index]; }
+		const Tile &tile(int index) const { Q_ASSERT(index>=0 && index<_xtiles*_ytiles); return _tiles.at(index); }
+
+		//! Get the tile storage
+		const TileMap &tiles() const { return _tiles; }
+
+		/**
+		 * @brief Get the set of tiles that may differ from the fill tile
+		 *
+		 * Tiles not in the set are guaranteed to be equal to the fill tile
+		 * (see TileMap::fillTile), which is usually null. A tile in the set
+		 * may still be equal to it, e.g. when its content has been erased.
+		 */
+		const TileBitmap &contentTiles() const { return _content; }
+
+		//! Get the bounding box of the tiles that may have content (in pixels)
+		QRect contentBounds() const;
 
 		//! Get the sublayers
 		const QList<Layer*> &sublayers() const { return _sublayers; }
@@ -164,6 +185,21 @@ class Layer {
 		//! Mark non-empty tiles as dirty
 		void markOpaqueDirty(bool forceVisible=false);
 
+		/**
+		 * @brief Restore compressed tiles to uncompressed form
+		 *
+		 * Tiles of hidden layers may be compressed (see TileCompressor.)
+		 * This should be called before the layer is shown again, since
+		 * reading a compressed tile is slow.
+		 */
+		void decompressTiles();
+
+		//! Set the minimum number of dabs in a stroke for parallel rendering
+		static void setParallelDabThreshold(int dabs);
+
+		//! Get the minimum number of dabs in a stroke for parallel rendering
+		static int parallelDabThreshold();
+
 		// Disable assignment operator
 		Layer& operator=(const Layer&) = delete;
 
@@ -174,14 +210,12 @@ class Layer {
 		//! Construct a sublayer
 		Layer(LayerStack *owner, int id, const QSize& size);
 
-		QImage padImageToTileBoundary(int leftpad, int toppad, const QImage &original, bool alpha) const;
-
 		//! Get a sublayer
 		Layer *getSubLayer(int id, int blendmode, uchar opacity);
 
-		void directDab(const Brush &brush, const BrushMaskGenerator& mask, const Point& point);
-		void drawHardLine(const Brush &brush, const BrushMaskGenerator& mask, const Point& from, const Point& to, qreal &distance);
-		void drawSoftLine(const Brush &brush, const BrushMaskGenerator& mask, const Point& from, const Point& to, qreal &distance);
+		void drawDabs(const Brush &brush, const BrushMaskGenerator& mask, const PointVector &dabs);
+		void drawHardLine(const Brush &brush, const Point& from, const Point& to, qreal &distance, PointVector &dabs);
+		void drawSoftLine(const Brush &brush, const Point& from, const Point& to, qreal &distance, PointVector &dabs);
 
 		LayerStack *_owner;
 		int id_;
@@ -191,7 +225,8 @@ class Layer {
 		int _height;
 		int _xtiles;
 		int _ytiles;
-		QVector<Tile> _tiles;
+		TileMap _tiles;
+		TileBitmap _content;
 		uchar _opacity;
 		int _blend;
 		bool _hidden;
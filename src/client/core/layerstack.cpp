@@ -24,24 +24,53 @@
 #include <QMimeData>
 #include <QtConcurrent>
 #include <QDataStream>
+#include <QTimer>
+#include <cstring>
 
 #include "annotation.h"
 #include "layer.h"
 #include "layerstack.h"
+#include "flattencache.h"
+#include "displaycache.h"
+#include "tilepyramid.h"
+#include "tilesnapshot.h"
+#include "renderworker.h"
 #include "tile.h"
 #include "rasterop.h"
 
 namespace paintcore {
 
+// Maximum size of the partially flattened tile cache
+static const int FLATTEN_CACHE_SIZE = 16 * 1024;
+
+static const QRect FULL_TILE(0, 0, Tile::SIZE, Tile::SIZE);
+
+// Minimum interval between areaChanged notifications (about one frame at 60 fps)
+static const int NOTIFY_INTERVAL = 16;
+
+// Maximum number of separate rectangles in the changed area
+static const int MAX_DIRTY_RECTS = 8;
+
 LayerStack::LayerStack(QObject *parent)
-	: QObject(parent), _width(0), _height(0)
+	: QObject(parent), _width(0), _height(0),
+	  _displaycache(new DisplayCache), _pyramid(new TilePyramid), _flattencache(new FlattenCache(FLATTEN_CACHE_SIZE)),
+	  _worker(0), _generation(0)
 {
+	_notifytimer = new QTimer(this);
+	_notifytimer->setSingleShot(true);
+	_notifytimer->setInterval(NOTIFY_INTERVAL);
+	connect(_notifytimer, SIGNAL(timeout()), this, SLOT(flushAreaChanged()));
 }
 
 LayerStack::~LayerStack()
 {
 	foreach(Layer *l, _layers)
 		delete l;
+	// The worker must be stopped before the caches it uses are deleted
+	delete _worker;
+	delete _displaycache;
+	delete _pyramid;
+	delete _flattencache;
 }
 
 void LayerStack::resize(int top, int right, int bottom, int left)
@@ -59,8 +88,13 @@ void LayerStack::resize(int top, int right, int bottom, int left)
 
 	_xtiles = Tile::roundTiles(_width);
 	_ytiles = Tile::roundTiles(_height);
-	_cache = QPixmap(_width, _height);
-	_dirtytiles = QBitArray(_xtiles*_ytiles, true);
+	_dirtytiles = TileBitmap(_xtiles, _ytiles);
+	_dirtytiles.setAll();
+	_dirtyareas.clear();
+	_displaycache->clear();
+	_pyramid->resize(_xtiles, _ytiles);
+	resetPending();
+	_flattencache->clear();
 
 	foreach(Layer *l, _layers)
 		l->resize(top, right, bottom, left);
@@ -253,99 +287,326 @@ void LayerStack::setLayerHidden(int layerid, bool hide)
 	}
 }
 
-namespace {
-
-struct UpdateTile {
-	UpdateTile() : x(-1), y(-1) {}
-	UpdateTile(int x_, int y_) : x(x_), y(y_) {}
-
-	int x, y;
-	quint32 data[Tile::LENGTH];
-};
-
-}
-
 /**
  * Paint a view of the layer stack. The layers are composited
  * together according to their options.
+ *
+ * The tiles are flattened in a background thread, so painting never
+ * waits for the layers to be composited. Tiles that are missing or out
+ * of date are sent to the render worker. Until they are ready, the old
+ * version of the tile (or nothing) is painted. The caller must listen to
+ * the rendered() signal and repaint the area when it is emitted.
+ *
+ * When the view is zoomed out, a downscaled level of the tile pyramid
+ * is painted instead of the full size tiles.
+ *
  * @param rect area of image to paint
  * @param painter painter to use
+ * @param scale the scale at which the image will appear on screen
  */
-void LayerStack::paint(const QRectF& rect, QPainter *painter)
+void LayerStack::paint(const QRectF& rect, QPainter *painter, qreal scale)
 {
 	if(_width<=0 || _height<=0)
 		return;
 
+	if(!_worker) {
+		_worker = new RenderWorker(_flattencache, this);
+		connect(_worker, SIGNAL(rendered()), this, SLOT(applyRenderResults()));
+		_worker->start();
+	}
+
+	// Pick the smallest pyramid level that is still at least as large as the view
+	int level = 0;
+	while(level < _pyramid->levels() && scale * (2 << level) <= 1.0)
+		++level;
+
+	if(level>0) {
+		paintPyramid(rect, painter, level);
+		return;
+	}
+
 	// Affected tile range
 	const int tx0 = qBound(0, int(rect.left()) / Tile::SIZE, _xtiles-1);
 	const int tx1 = qBound(tx0, int(rect.right()) / Tile::SIZE, _xtiles-1);
 	const int ty0 = qBound(0, int(rect.top()) / Tile::SIZE, _ytiles-1);
 	const int ty1 = qBound(ty0, int(rect.bottom()) / Tile::SIZE, _ytiles-1);
 
-	// Gather list of tiles in need of updating
-	QList<UpdateTile*> updates;
+	// Request the tiles in need of updating. Tiles not in
+	// the display cache must be flattened completely.
+	// A tile that is already being rendered is requested again
+	// (if it has changed since) only after the result has arrived.
+	QList<RenderJob> jobs;
+	QVector<QPair<int, QPixmap>> tiles;
+	const bool erase = hasEraseModeLayers();
 
 	for(int ty=ty0;ty<=ty1;++ty) {
 		const int y = ty*_xtiles;
 		for(int tx=tx0;tx<=tx1;++tx) {
 			const int i = y+tx;
-			if(_dirtytiles.testBit(i)) {
-				updates.append(new UpdateTile(tx, ty));
-				_dirtytiles.clearBit(i);
+			const QPixmap *cached = _displaycache->object(i);
+
+			if(!_pendingtiles.test(i) && (!cached || _dirtytiles.test(i))) {
+				RenderJob job;
+				job.x = tx;
+				job.y = ty;
+				job.rect = cached ? _dirtyareas.value(i, FULL_TILE) : FULL_TILE;
+				job.tiles.append(TileSnapshot(_layers, tx, ty));
+				job.xtiles = _xtiles;
+				job.erase = erase;
+				job.generation = _generation;
+				jobs.append(job);
+
+				_pendingtiles.set(i);
+				_dirtytiles.clear(i);
+				_dirtyareas.remove(i);
 			}
+
+			if(cached)
+				tiles.append(qMakePair(i, *cached));
+		}
+	}
+
+	_worker->submit(jobs);
+
+	// Paint the cached tiles
+	const QRect area = rect.toAlignedRect() & QRect(0, 0, _width, _height);
+	for(int t=0;t<tiles.size();++t) {
+		const int i = tiles.at(t).first;
+		const QRect tilerect((i % _xtiles) * Tile::SIZE, (i / _xtiles) * Tile::SIZE, Tile::SIZE, Tile::SIZE);
+		const QRect r = tilerect & area;
+		if(!r.isEmpty())
+			painter->drawPixmap(r, tiles.at(t).second, r.translated(-tilerect.topLeft()));
+	}
+}
+
+/**
+ * Paint a view of the layer stack using a level of the tile pyramid.
+ */
+void LayerStack::paintPyramid(const QRectF &rect, QPainter *painter, int level)
+{
+	const int tilesize = Tile::SIZE << level;
+	const int xtiles = _pyramid->xtiles(level);
+	const int ytiles = _pyramid->ytiles(level);
+
+	const int tx0 = qBound(0, int(rect.left()) / tilesize, xtiles-1);
+	const int tx1 = qBound(tx0, int(rect.right()) / tilesize, xtiles-1);
+	const int ty0 = qBound(0, int(rect.top()) / tilesize, ytiles-1);
+	const int ty1 = qBound(ty0, int(rect.bottom()) / tilesize, ytiles-1);
+
+	QList<RenderJob> jobs;
+	QVector<QPair<QPoint, QImage>> tiles;
+
+	for(int ty=ty0;ty<=ty1;++ty) {
+		for(int tx=tx0;tx<=tx1;++tx) {
+			QImage tile = pyramidTile(level, tx, ty, jobs);
+			if(tile.isNull()) {
+				// Paint the old version of the tile until the new one is ready
+				const QImage *old = _pyramid->object(level, tx, ty);
+				if(old)
+					tile = *old;
+			}
+
+			if(!tile.isNull())
+				tiles.append(qMakePair(QPoint(tx, ty), tile));
+		}
+	}
+
+	_worker->submit(jobs);
+
+	// Paint the tiles scaled back to canvas coordinates
+	const QRectF area = rect & QRectF(0, 0, _width, _height);
+	const qreal factor = 1 << level;
+	for(int t=0;t<tiles.size();++t) {
+		const QPoint &pos = tiles.at(t).first;
+		const QRectF tilerect(pos.x() * tilesize, pos.y() * tilesize, tilesize, tilesize);
+		const QRectF r = tilerect & area;
+		if(!r.isEmpty()) {
+			const QRectF src((r.x() - tilerect.x()) / factor, (r.y() - tilerect.y()) / factor, r.width() / factor, r.height() / factor);
+			painter->drawImage(r, tiles.at(t).second, src);
+		}
+	}
+}
+
+/**
+ * Get an up to date tile of the pyramid.
+ *
+ * An out of date tile is rebuilt from the level below, recursing down
+ * only along the branches that have changed or have dropped out of the cache.
+ * The tiles of the first level are built from the flattened full size tiles
+ * by the render worker: jobs for them are added to the given list.
+ *
+ * @return null if the tile is not ready yet
+ */
+QImage LayerStack::pyramidTile(int level, int x, int y, QList<RenderJob> &jobs)
+{
+	const QImage *cached = _pyramid->object(level, x, y);
+	const bool dirty = _pyramid->isDirty(level, x, y);
+
+	if(level==1) {
+		const int i = y * _pyramid->xtiles(1) + x;
+		if(_pendingpyramid.test(i))
+			return QImage();
+
+		if(cached && !dirty)
+			return *cached;
+
+		RenderJob job;
+		job.level = 1;
+		job.x = x;
+		job.y = y;
+		for(int q=0;q<4;++q) {
+			const int cx = x*2 + q%2;
+			const int cy = y*2 + q/2;
+			if(cx < _xtiles && cy < _ytiles)
+				job.tiles.append(TileSnapshot(_layers, cx, cy));
+			else
+				job.tiles.append(TileSnapshot());
 		}
+		job.xtiles = _xtiles;
+		job.erase = hasEraseModeLayers();
+		job.generation = _generation;
+		jobs.append(job);
+
+		_pendingpyramid.set(i);
+		_pyramid->setClean(1, x, y);
+		return QImage();
 	}
 
-	if(!updates.isEmpty()) {
-		// Flatten tiles
-		QtConcurrent::blockingMap(updates, [this](UpdateTile *t) {
-			flattenTile(t->data, t->x, t->y);
-		});
-
-		// Repaint cache
-		QPainter cache(&_cache);
-		cache.setCompositionMode(QPainter::CompositionMode_Source);
-		while(!updates.isEmpty()) {
-			UpdateTile *ut = updates.takeLast();
-			cache.drawImage(
-				ut->x*Tile::SIZE,
-				ut->y*Tile::SIZE,
-				QImage(reinterpret_cast<const uchar*>(ut->data),
-					Tile::SIZE, Tile::SIZE,
-					QImage::Format_ARGB32
-				)
-			);
-			delete ut;
+	if(cached && !dirty)
+		return *cached;
+
+	const int cxtiles = _pyramid->xtiles(level-1);
+	const int cytiles = _pyramid->ytiles(level-1);
+
+	// All children are requested before giving up, so they can be rendered in parallel
+	QImage children[4];
+	bool ready = true;
+	for(int q=0;q<4;++q) {
+		const int cx = x*2 + q%2;
+		const int cy = y*2 + q/2;
+		if(cx < cxtiles && cy < cytiles) {
+			children[q] = pyramidTile(level-1, cx, cy, jobs);
+			if(children[q].isNull())
+				ready = false;
 		}
 	}
 
-	// Paint the cached pixmap
-	painter->drawPixmap(rect, _cache, rect);
+	if(!ready)
+		return QImage();
+
+	QImage tile = TilePyramid::emptyTile();
+	for(int q=0;q<4;++q) {
+		if(!children[q].isNull())
+			TilePyramid::downscale(reinterpret_cast<const quint32*>(children[q].constBits()), tile, q);
+	}
+
+	_pyramid->insert(level, x, y, tile);
+	_pyramid->setClean(level, x, y);
+	return tile;
 }
 
-QColor LayerStack::colorAt(int x, int y) const
+/**
+ * Put the tiles finished by the render worker into the display caches
+ * and request the areas to be repainted.
+ */
+void LayerStack::applyRenderResults()
+{
+	QRect changed;
+
+	foreach(const RenderResult &r, _worker->takeResults()) {
+		// Results from before the canvas was resized are useless
+		if(r.generation != _generation)
+			continue;
+
+		if(r.level==0) {
+			const int i = r.y*_xtiles + r.x;
+			_pendingtiles.clear(i);
+
+			// The cached tile is taken out of the cache while it is being updated,
+			// so updating the other tiles can't evict it
+			QPixmap pixmap = r.rect == FULL_TILE ? QPixmap::fromImage(r.image) : _displaycache->take(i);
+
+			// If only part of the tile was flattened but the cached tile is gone,
+			// the whole tile will be requested again when it is next painted.
+			if(!pixmap.isNull()) {
+				if(r.rect != FULL_TILE) {
+					QPainter tp(&pixmap);
+					tp.setCompositionMode(QPainter::CompositionMode_Source);
+					tp.drawImage(r.rect.topLeft(), r.image, r.rect);
+				}
+				_displaycache->insert(i, pixmap);
+			}
+
+			changed |= QRect(r.x*Tile::SIZE, r.y*Tile::SIZE, Tile::SIZE, Tile::SIZE);
+
+		} else {
+			_pendingpyramid.clear(r.y * _pyramid->xtiles(1) + r.x);
+			_pyramid->insert(1, r.x, r.y, r.image);
+
+			const int size = Tile::SIZE * 2;
+			changed |= QRect(r.x*size, r.y*size, size, size);
+		}
+	}
+
+	changed &= QRect(0, 0, _width, _height);
+	if(!changed.isEmpty())
+		emit rendered(changed);
+}
+
+/**
+ * @param x
+ * @param y
+ * @param dia diameter of the sampled area. If greater than one,
+ *            the average color of the area centered at x,y is returned
+ * @return invalid color if x or y is outside image boundaries
+ */
+QColor LayerStack::colorAt(int x, int y, int dia) const
 {
 	if(_layers.isEmpty())
 		return QColor();
 
-	if(x<0 || y<0 || x>=_width || y>=_height)
+	if(dia <= 1) {
+		if(x<0 || y<0 || x>=_width || y>=_height)
+			return QColor();
+
+		return QColor(flattenPixel(x, y));
+	}
+
+	const QRect area = QRect(x - dia/2, y - dia/2, dia, dia) & QRect(0, 0, _width, _height);
+	if(area.isEmpty())
 		return QColor();
 
-	// TODO some more efficient way of doing this
-	quint32 tile[Tile::SIZE*Tile::SIZE];
-	flattenTile(tile, x/Tile::SIZE, y/Tile::SIZE);
-	quint32 c = tile[(y-Tile::roundDown(y)) * Tile::SIZE + (x-Tile::roundDown(x))];
-	return QColor(c);
+	// Average of the sampled pixels, weighted by alpha
+	quint64 r=0, g=0, b=0, a=0;
+	for(int py=area.top();py<=area.bottom();++py) {
+		for(int px=area.left();px<=area.right();++px) {
+			const quint32 c = flattenPixel(px, py);
+			r += qRed(c) * qAlpha(c);
+			g += qGreen(c) * qAlpha(c);
+			b += qBlue(c) * qAlpha(c);
+			a += qAlpha(c);
+		}
+	}
+
+	if(a == 0)
+		return QColor(0, 0, 0, 0);
+
+	const int n = area.width() * area.height();
+	return QColor((r + a/2) / a, (g + a/2) / a, (b + a/2) / a, (a + n/2) / n);
 }
 
+/**
+ * The image is flattened one row of tiles at a time, directly into
+ * the returned image, so no temporary canvas sized layer is needed.
+ *
+ * @param includeAnnotations paint annotations on top of the image
+ */
 QImage LayerStack::toFlatImage(bool includeAnnotations) const
 {
-	Layer flat(0, 0, "", Qt::transparent, QSize(_width, _height));
+	QImage image(_width, _height, QImage::Format_ARGB32);
 
-	foreach(const Layer *l, _layers)
-		flat.merge(l, true);
-
-	QImage image = flat.toImage();
+	for(int row=0;row<_ytiles;++row)
+		flattenBand(row, image.scanLine(row * Tile::SIZE), image.bytesPerLine());
 
 	if(includeAnnotations) {
 		QPainter painter(&image);
@@ -356,41 +617,155 @@ QImage LayerStack::toFlatImage(bool includeAnnotations) const
 	return image;
 }
 
-// Flatten a single tile
-void LayerStack::flattenTile(quint32 *data, int xindex, int yindex) const
+/**
+ * Get a horizontal band of the flattened image, without annotations.
+ * The band is one tile row tall (except for the last band, which may be shorter)
+ * and spans the whole width of the layer stack.
+ *
+ * This can be used to process the flattened image in parts, without
+ * having to keep the whole image in memory at once.
+ * The result is the same as the corresponding part of toFlatImage(false).
+ *
+ * @param row band index (0..flatBands()-1)
+ */
+QImage LayerStack::toFlatBand(int row) const
+{
+	Q_ASSERT(row>=0 && row<_ytiles);
+	QImage band(_width, qMin(Tile::SIZE, _height - row * Tile::SIZE), QImage::Format_ARGB32);
+	flattenBand(row, band.bits(), band.bytesPerLine());
+	return band;
+}
+
+/**
+ * The layers are merged on top of a transparent background the same
+ * way Layer::merge would merge them. The tiles of the row are flattened in parallel.
+ *
+ * @param row tile row
+ * @param bits start of the first scanline of the band
+ * @param bytesPerLine scanline length
+ */
+void LayerStack::flattenBand(int row, uchar *bits, int bytesPerLine) const
 {
-	// Start out with a checkerboard pattern to denote transparency
-	Tile::fillChecker(data, QColor(128,128,128), Qt::white);
+	const int h = qMin(Tile::SIZE, _height - row * Tile::SIZE);
 
-	// Composite visible layers
+	QVector<int> columns(_xtiles);
+	for(int i=0;i<_xtiles;++i)
+		columns[i] = i;
+
+	QtConcurrent::blockingMap(columns, [this, row, h, bits, bytesPerLine](int col) {
+		quint32 data[Tile::LENGTH];
+		memset(data, 0, Tile::BYTES);
+
+		// Reading tiles does not modify them (compressed tiles are
+		// decompressed into a temporary copy), so the layers' tiles
+		// can be used directly from the worker threads.
+		foreach(const Layer *l, _layers) {
+			l->tile(col, row).mergeTo(data, l->opacity(), l->blendmode());
+
+			foreach(const Layer *sl, l->sublayers()) {
+				if(sl->visible())
+					sl->tile(col, row).mergeTo(data, sl->opacity(), sl->blendmode());
+			}
+		}
+
+		const int x = col * Tile::SIZE;
+		const int w = qMin(Tile::SIZE, _width - x);
+		for(int y=0;y<h;++y)
+			memcpy(bits + y * bytesPerLine + x * 4, data + y * Tile::SIZE, w * 4);
+	});
+}
+
+bool LayerStack::hasEraseModeLayers() const
+{
 	foreach(const Layer *l, _layers) {
-		if(l->visible()) {
-			const Tile &tile = l->tile(xindex, yindex);
-			if(l->sublayers().count()) {
-				// Sublayers present, composite them first
-				quint32 ldata[Tile::SIZE*Tile::SIZE];
-				tile.copyTo(ldata);
-
-				foreach(const Layer *sl, l->sublayers()) {
-					if(sl->visible()) {
-						const Tile &subtile = sl->tile(xindex, yindex);
-						if(!subtile.isNull()) {
-							compositePixels(sl->blendmode(), ldata, subtile.data(),
-									Tile::SIZE*Tile::SIZE, sl->opacity());
-						}
-					}
-				}
+		if(l->visible() && l->blendmode() == 0)
+			return true;
+	}
+	return false;
+}
+
+namespace {
+
+bool hasVisibleSublayers(const Layer *layer)
+{
+	foreach(const Layer *sl, layer->sublayers())
+		if(sl->visible())
+			return true;
+	return false;
+}
 
-				// Composite merged tile
-				compositePixels(l->blendmode(), data, ldata,
-						Tile::SIZE*Tile::SIZE, l->opacity());
-			} else if(!tile.isNull()) {
-				// No sublayers, just this tile
-				compositePixels(l->blendmode(), data, tile.data(),
-						Tile::SIZE*Tile::SIZE, l->opacity());
+}
+
+/**
+ * Composite the visible layers at a single pixel.
+ *
+ * The result is the same as the corresponding pixel of flattenTile,
+ * but only the layers at this one pixel need to be looked at.
+ */
+quint32 LayerStack::flattenPixel(int x, int y) const
+{
+	const int xindex = x / Tile::SIZE;
+	const int yindex = y / Tile::SIZE;
+	const int tx = x - xindex * Tile::SIZE;
+	const int ty = y - yindex * Tile::SIZE;
+
+	// Find the topmost layer whose pixel hides everything below it
+	quint32 color = 0;
+	int i = _layers.count() - 1;
+	while(i>=0) {
+		const Layer *l = _layers.at(i);
+		if(l->visible() && l->opacity() == 255 && l->blendmode() == 1 && !hasVisibleSublayers(l)) {
+			const quint32 c = l->tile(xindex, yindex).pixel(tx, ty);
+			if(qAlpha(c) == 255) {
+				color = c;
+				break;
+			}
+		}
+		--i;
+	}
+
+	if(i<0) {
+		// Checkerboard background (see TileSnapshot::beginFlattening)
+		const bool dark = (tx < Tile::SIZE/2) == (ty < Tile::SIZE/2);
+		color = dark ? QColor(128,128,128).rgba() : QColor(Qt::white).rgba();
+	}
+
+	for(++i;i<_layers.count();++i) {
+		const Layer *l = _layers.at(i);
+		if(!l->visible())
+			continue;
+
+		quint32 c = l->tile(xindex, yindex).pixel(tx, ty);
+		foreach(const Layer *sl, l->sublayers()) {
+			if(sl->visible()) {
+				const quint32 sc = sl->tile(xindex, yindex).pixel(tx, ty);
+				compositePixels(sl->blendmode(), &c, &sc, 1, sl->opacity());
 			}
 		}
+		compositePixels(l->blendmode(), &color, &c, 1, l->opacity());
 	}
+
+	return color;
+}
+
+// Flatten a single tile
+void LayerStack::flattenTile(quint32 *data, int xindex, int yindex) const
+{
+	TileSnapshot(_layers, xindex, yindex).flatten(data);
+}
+
+/**
+ * Forget the tiles being rendered. Results for them will be ignored.
+ * This must be called whenever the size of the canvas changes.
+ */
+void LayerStack::resetPending()
+{
+	++_generation;
+	_pendingtiles = TileBitmap(_xtiles, _ytiles);
+	if(_pyramid->levels()>0)
+		_pendingpyramid = TileBitmap(_pyramid->xtiles(1), _pyramid->ytiles(1));
+	else
+		_pendingpyramid = TileBitmap();
 }
 
 void LayerStack::markDirty(const QRect &area)
@@ -401,22 +776,42 @@ void LayerStack::markDirty(const QRect &area)
 	int tx1 = qBound(tx0, area.right() / Tile::SIZE, _xtiles-1);
 	int ty0 = qBound(0, area.top() / Tile::SIZE, _ytiles-1);
 	int ty1 = qBound(ty0, area.bottom() / Tile::SIZE, _ytiles-1);
+
+	_pyramid->markDirty(QRect(QPoint(tx0, ty0), QPoint(tx1, ty1)));
 	
+	// Remember which part of each tile was changed
 	for(;ty0<=ty1;++ty0) {
 		for(int tx=tx0;tx<=tx1;++tx) {
-			_dirtytiles.setBit(ty0*_xtiles + tx);
+			const QPoint origin(tx*Tile::SIZE, ty0*Tile::SIZE);
+			const QRect r = area.translated(-origin).intersected(FULL_TILE);
+			if(r.isEmpty())
+				continue;
+
+			const int i = ty0*_xtiles + tx;
+			if(!_dirtytiles.test(i)) {
+				_dirtytiles.set(i);
+				_dirtyareas.insert(i, r);
+			} else {
+				// Tiles without a dirty rect are already completely dirty
+				QHash<int, QRect>::iterator dirty = _dirtyareas.find(i);
+				if(dirty != _dirtyareas.end())
+					dirty.value() = dirty.value().united(r);
+			}
 		}
 	}
-	_dirtyrect |= area;
+	addDirtyRect(area);
 }
 
 void LayerStack::markDirty()
 {
 	if(_layers.isEmpty())
 		return;
-	_dirtytiles.fill(true);
+	_dirtytiles.setAll();
+	_dirtyareas.clear();
+	_pyramid->markDirty();
 
-	_dirtyrect = QRect(0, 0, _width, _height);
+	_dirtyrects.clear();
+	addDirtyRect(QRect(0, 0, _width, _height));
 	notifyAreaChanged();
 }
 
@@ -425,28 +820,106 @@ void LayerStack::markDirty(int x, int y)
 	Q_ASSERT(x>=0 && x < _xtiles);
 	Q_ASSERT(y>=0 && y < _ytiles);
 
-	_dirtytiles.setBit(y*_xtiles + x);
+	_dirtytiles.set(x, y);
+	_dirtyareas.remove(y*_xtiles + x);
+	_pyramid->markDirty(QRect(x, y, 1, 1));
 
-	_dirtyrect |= QRect(x*Tile::SIZE, y*Tile::SIZE, Tile::SIZE, Tile::SIZE);
+	addDirtyRect(QRect(x*Tile::SIZE, y*Tile::SIZE, Tile::SIZE, Tile::SIZE));
 }
 
 void LayerStack::markDirty(int index)
 {
-	Q_ASSERT(index>=0 && index < _dirtytiles.size());
+	Q_ASSERT(index>=0 && index < _xtiles*_ytiles);
 
-	_dirtytiles.setBit(index);
+	_dirtytiles.set(index);
+	_dirtyareas.remove(index);
 
 	const int y = index / _xtiles;
 	const int x = index % _xtiles;
 
-	_dirtyrect |= QRect(x*Tile::SIZE, y*Tile::SIZE, Tile::SIZE, Tile::SIZE);
+	_pyramid->markDirty(QRect(x, y, 1, 1));
+
+	addDirtyRect(QRect(x*Tile::SIZE, y*Tile::SIZE, Tile::SIZE, Tile::SIZE));
 }
 
 void LayerStack::notifyAreaChanged()
 {
-	if(!_dirtyrect.isEmpty()) {
-		emit areaChanged(_dirtyrect);
-		_dirtyrect = QRect();
+	if(!_dirtyrects.isEmpty() && !_notifytimer->isActive())
+		_notifytimer->start();
+}
+
+void LayerStack::flushAreaChanged()
+{
+	_notifytimer->stop();
+
+	// (Copied, since the slots may mark more areas as changed)
+	const QVector<QRect> rects = _dirtyrects;
+	_dirtyrects.clear();
+	foreach(const QRect &r, rects)
+		emit areaChanged(r);
+}
+
+namespace {
+
+inline qint64 rectArea(const QRect &r)
+{
+	return qint64(r.width()) * r.height();
+}
+
+// Unchanged area that would be included if the two rectangles were merged
+qint64 mergeCost(const QRect &a, const QRect &b)
+{
+	return rectArea(a | b) - rectArea(a) - rectArea(b) + rectArea(a & b);
+}
+
+}
+
+/**
+ * Add a rectangle to the changed area.
+ *
+ * Instead of a single bounding rectangle, the area is kept as a short list
+ * of rectangles, so changes in distant parts of the canvas don't cause
+ * everything between them to be repainted. A new rectangle is merged with
+ * an existing one if that adds no more than a tile's worth of unchanged
+ * area. When there are too many rectangles, the pair that is cheapest to
+ * merge is merged.
+ */
+void LayerStack::addDirtyRect(const QRect &rect)
+{
+	if(rect.isEmpty())
+		return;
+
+	QRect r = rect;
+	for(int i=0;i<_dirtyrects.size();) {
+		if(_dirtyrects.at(i).contains(r))
+			return;
+
+		if(mergeCost(_dirtyrects.at(i), r) <= Tile::LENGTH) {
+			// The merged rectangle may now overlap the ones already checked
+			r |= _dirtyrects.at(i);
+			_dirtyrects.remove(i);
+			i = 0;
+		} else {
+			++i;
+		}
+	}
+	_dirtyrects.append(r);
+
+	if(_dirtyrects.size() > MAX_DIRTY_RECTS) {
+		int besti = 0, bestj = 1;
+		qint64 best = mergeCost(_dirtyrects.at(0), _dirtyrects.at(1));
+		for(int i=0;i<_dirtyrects.size();++i) {
+			for(int j=i+1;j<_dirtyrects.size();++j) {
+				const qint64 cost = mergeCost(_dirtyrects.at(i), _dirtyrects.at(j));
+				if(cost < best) {
+					best = cost;
+					besti = i;
+					bestj = j;
+				}
+			}
+		}
+		_dirtyrects[besti] |= _dirtyrects.at(bestj);
+		_dirtyrects.remove(bestj);
 	}
 }
 
@@ -483,8 +956,13 @@ void LayerStack::restoreSavepoint(const Savepoint *savepoint)
 		_height = savepoint->height;
 		_xtiles = Tile::roundTiles(_width);
 		_ytiles = Tile::roundTiles(_height);
-		_cache = QPixmap(_width, _height);
-		_dirtytiles = QBitArray(_xtiles*_ytiles, true);
+		_dirtytiles = TileBitmap(_xtiles, _ytiles);
+		_dirtytiles.setAll();
+		_dirtyareas.clear();
+		_displaycache->clear();
+		_pyramid->resize(_xtiles, _ytiles);
+		resetPending();
+		_flattencache->clear();
 		emit resized(0, 0);
 	} else {
 		// Mark changed tiles as changed. Usually savepoints are quite close together
@@ -502,11 +980,19 @@ void LayerStack::restoreSavepoint(const Savepoint *savepoint)
 					markDirty();
 					break;
 				}
-				for(int i=0;i<_xtiles*_ytiles;++i) {
-					// Note: An identity comparison works here, because the tiles
-					// utilize copy-on-write semantics. Unchanged tiles will share
-					// data pointers between savepoints.
-					if(l0->tile(i) != l1->tile(i))
+				if(l0->tiles().fillTile().revision() != l1->tiles().fillTile().revision()) {
+					// The whole layer has changed
+					markDirty();
+					break;
+				}
+				// Tiles outside the content sets are equal to the fill tile in both layers
+				TileBitmap tiles = l0->contentTiles();
+				tiles.unite(l1->contentTiles());
+				foreach(int i, tiles.indexes()) {
+					// Note: Comparing revisions works here, because the tiles
+					// utilize copy-on-write semantics. Unchanged tiles keep their
+					// revision between savepoints, even when compressed.
+					if(l0->tile(i).revision() != l1->tile(i).revision())
 						markDirty(i);
 				}
 			}
@@ -516,8 +1002,13 @@ void LayerStack::restoreSavepoint(const Savepoint *savepoint)
 	// Restore layers
 	while(!_layers.isEmpty())
 		delete _layers.takeLast();
-	foreach(const Layer *l, savepoint->layers)
-		_layers.append(new Layer(*l));
+	foreach(const Layer *l, savepoint->layers) {
+		Layer *copy = new Layer(*l);
+		// Old savepoints may have been compressed
+		if(copy->visible())
+			copy->decompressTiles();
+		_layers.append(copy);
+	}
 
 	// Restore annotations
 	QSet<int> annotations;
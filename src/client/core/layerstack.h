@@ -24,17 +24,27 @@
 
 #include <QObject>
 #include <QList>
+#include <QHash>
 #include <QImage>
 #include <QPixmap>
-#include <QBitArray>
+#include <QVector>
+#include <QRect>
+
+#include "tilebitmap.h"
 
 class QDataStream;
+class QTimer;
 
 namespace paintcore {
 
 class Annotation;
 class Layer;
 class Savepoint;
+class FlattenCache;
+class DisplayCache;
+class TilePyramid;
+class RenderWorker;
+struct RenderJob;
 
 /**
  * \brief A stack of layers.
@@ -105,15 +115,24 @@ class LayerStack : public QObject {
 		//! Get the width and height of the layer stack
 		QSize size() const { return QSize(_width, _height); }
 
-		//! Paint an area of this layer stack
-		void paint(const QRectF& rect, QPainter *painter);
+		//! Paint an area of this layer stack (repaint again when rendered() is emitted)
+		void paint(const QRectF& rect, QPainter *painter, qreal scale=1.0);
+
+		//! Get the merged color value at the point (or the average color around it)
+		QColor colorAt(int x, int y, int dia=1) const;
 
-		//! Get the merged color value at the point
-		QColor colorAt(int x, int y) const;
+		//! Composite the visible layers of a single tile into the given buffer
+		void flattenTile(quint32 *data, int xindex, int yindex) const;
 
 		//! Return a flattened image of the layer stack
 		QImage toFlatImage(bool includeAnnotations) const;
 
+		//! Get the number of bands toFlatBand can return
+		int flatBands() const { return _ytiles; }
+
+		//! Return a band of scanlines of the flattened image
+		QImage toFlatBand(int row) const;
+
 		//! Mark the tiles under the area dirty
 		void markDirty(const QRect &area);
 
@@ -126,7 +145,12 @@ class LayerStack : public QObject {
 		//! Mark the tile at the given index as dirty
 		void markDirty(int index);
 
-		//! Emit areaChanged if anything has been marked as dirty
+		/**
+		 * @brief Schedule areaChanged to be emitted if anything has been marked as dirty
+		 *
+		 * Notifications are coalesced: the changes are collected and
+		 * announced at most once per display frame.
+		 */
 		void notifyAreaChanged();
 
 		//! Create a new savepoint
@@ -139,32 +163,66 @@ class LayerStack : public QObject {
 		//! Set or clear the "hidden" flag of a layer
 		void setLayerHidden(int layerid, bool hide);
 
+		//! Emit areaChanged right away if anything has been marked as dirty
+		void flushAreaChanged();
+
 	signals:
 		//! Emitted when the visible layers are edited
 		void areaChanged(const QRect &area);
 
+		//! Emitted when tiles have been rendered in the background and are ready to be painted
+		void rendered(const QRect &area);
+
 		//! Layer width/height changed
 		void resized(int xoffset, int yoffset);
 
 		//! Annotation with the given ID was just changed. (This includes addition and deletion)
 		void annotationChanged(int id);
 
+	private slots:
+		void applyRenderResults();
+
 	private:
-		void flattenTile(quint32 *data, int xindex, int yindex) const;
+		bool hasEraseModeLayers() const;
+		quint32 flattenPixel(int x, int y) const;
+		void flattenBand(int row, uchar *bits, int bytesPerLine) const;
+		void paintPyramid(const QRectF &rect, QPainter *painter, int level);
+		QImage pyramidTile(int level, int x, int y, QList<RenderJob> &jobs);
+		void resetPending();
+		void addDirtyRect(const QRect &rect);
 
 		int _width, _height;
 		int _xtiles, _ytiles;
 		QList<Layer*> _layers;
 		QList<Annotation*> _annotations;
 
-		QPixmap _cache;
-		QBitArray _dirtytiles;
-		QRect _dirtyrect;
+		DisplayCache *_displaycache;
+		TilePyramid *_pyramid;
+		FlattenCache *_flattencache;
+		RenderWorker *_worker;
+
+		// Tiles sent to the render worker whose results haven't arrived yet
+		TileBitmap _pendingtiles;
+		TileBitmap _pendingpyramid;
+
+		// Incremented whenever the canvas is resized
+		int _generation;
+
+		// Tiles in need of repainting, and the dirty part of the tiles
+		// that have changed only partially (in tile coordinates.)
+		// Dirty tiles with no rect are completely dirty.
+		TileBitmap _dirtytiles;
+		QHash<int, QRect> _dirtyareas;
+
+		// Changed areas not yet announced with areaChanged
+		QVector<QRect> _dirtyrects;
+		QTimer *_notifytimer;
 };
 
 /// Layer stack savepoint for undo use
 class Savepoint {
 	friend class LayerStack;
+	friend class TileCompressor;
 public:
 	~Savepoint();
 
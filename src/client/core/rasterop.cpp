@@ -20,6 +20,13 @@
 
 #include "rasterop.h"
 
+#include <QStringList>
+#include <QDebug>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 namespace paintcore {
 
 const char *BLEND_MODE[BLEND_MODES] = {
@@ -139,8 +146,24 @@ inline uint blend_subtract(uchar base, uchar blend) {
 	return qMax(base-blend, 0);
 }
 
+/**
+ * A mask whose every value is the same.
+ *
+ * The mask composition functions are templates that accept either
+ * a pointer to real mask data or this.
+ */
+struct ConstMask {
+	explicit ConstMask(uchar v) : value(v) { }
+	uchar operator*() const { return value; }
+	ConstMask &operator++() { return *this; }
+	ConstMask &operator+=(int) { return *this; }
+
+	uchar value;
+};
+
 // Normal alpha blend
-void doAlphaMaskBlend(quint32 *base, quint32 color, const uchar *mask,
+template<typename Mask>
+void doAlphaMaskBlend(quint32 *base, quint32 color, Mask mask,
 		int w, int h, int maskskip, int baseskip)
 {
 	baseskip *= 4;
@@ -182,7 +205,8 @@ void doAlphaMaskBlend(quint32 *base, quint32 color, const uchar *mask,
 }
 
 // Specialized pixel composition: erase alpha channel
-void doMaskErase(quint32 *base, const uchar *mask, int w, int h, int maskskip, int baseskip)
+template<typename Mask>
+void doMaskErase(quint32 *base, Mask mask, int w, int h, int maskskip, int baseskip)
 {
 	baseskip *= 4;
 	uchar *dest = reinterpret_cast<uchar*>(base) + 3;
@@ -199,7 +223,8 @@ void doMaskErase(quint32 *base, const uchar *mask, int w, int h, int maskskip, i
 }
 
 // Specialized pixel composition: copy source without any blending
-void doMaskCopy(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+template<typename Mask>
+void doMaskCopy(quint32 *base, quint32 color, Mask mask, int w, int h, int maskskip, int baseskip)
 {
 	baseskip *= 4;
 	uchar *dest = reinterpret_cast<uchar*>(base);
@@ -220,8 +245,8 @@ void doMaskCopy(quint32 *base, quint32 color, const uchar *mask, int w, int h, i
 // A generic composition function for special blending modes
 // This doesn't touch the alpha channel.
 typedef uint(*BlendOp)(uchar,uchar);
-template<BlendOp BO>
-void doMaskComposite(quint32 *base, quint32 color, const uchar *mask,
+template<BlendOp BO, typename Mask>
+void doMaskComposite(quint32 *base, quint32 color, Mask mask,
 		int w, int h, int maskskip, int baseskip)
 {
 	baseskip *= 4;
@@ -265,6 +290,15 @@ void doPixelAlphaBlend(quint32 *destination, const quint32 *source, uchar opacit
 
 	while(len--) {
 		const uchar a = UINT8_MULT(src[3], opacity);
+		if(dest[3]==255) {
+			// Special case: destination is opaque. (The usual case when flattening the layer stack.)
+			// The result stays opaque and division by a_out=255 is an identity operation.
+			*dest = UINT8_MULT(a, *src) + UINT8_MULT(255-a, *dest); ++dest,++src;
+			*dest = UINT8_MULT(a, *src) + UINT8_MULT(255-a, *dest); ++dest,++src;
+			*dest = UINT8_MULT(a, *src) + UINT8_MULT(255-a, *dest); ++dest,++src;
+			++dest,++src;
+			continue;
+		}
 		const uchar a2 = UINT8_MULT(dest[3], 255-a);
 		const uchar a_out = a+a2;
 		if(a_out==0) {
@@ -317,7 +351,8 @@ void doPixelComposite(quint32 *destination, const quint32 *source, uchar alpha,
 	}
 }
 
-void compositeMask(int mode, quint32 *base, quint32 color, const uchar *mask,
+template<typename Mask>
+static void compositeGeneric(int mode, quint32 *base, quint32 color, Mask mask,
 		int w, int h, int maskskip, int baseskip)
 {
 	// Note! Make sure the these are in the correct order!
@@ -336,7 +371,18 @@ void compositeMask(int mode, quint32 *base, quint32 color, const uchar *mask,
 	}
 }
 
-void compositePixels(int mode, quint32 *base, const quint32 *over, int len, uchar opacity)
+static void compositeMaskGeneric(int mode, quint32 *base, quint32 color, const uchar *mask,
+		int w, int h, int maskskip, int baseskip)
+{
+	compositeGeneric(mode, base, color, mask, w, h, maskskip, baseskip);
+}
+
+static void compositeColorGeneric(int mode, quint32 *base, quint32 color, uchar alpha, int len)
+{
+	compositeGeneric(mode, base, color, ConstMask(alpha), len, 1, 0, 0);
+}
+
+static void compositePixelsGeneric(int mode, quint32 *base, const quint32 *over, int len, uchar opacity)
 {
 	// Note! Make sure the these are in the correct order!
 	switch(mode) {
@@ -353,4 +399,151 @@ void compositePixels(int mode, quint32 *base, const quint32 *over, int len, ucha
 	}
 }
 
+#ifdef HAVE_X86_RASTEROPS
+// These are implemented in rasterop_sse2.cpp, rasterop_sse41.cpp and rasterop_avx2.cpp
+void compositeMask_sse2(int mode, quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip);
+void compositePixels_sse2(int mode, quint32 *base, const quint32 *over, int len, uchar opacity);
+void compositeColor_sse2(int mode, quint32 *base, quint32 color, uchar alpha, int len);
+void compositeMask_sse41(int mode, quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip);
+void compositePixels_sse41(int mode, quint32 *base, const quint32 *over, int len, uchar opacity);
+void compositeColor_sse41(int mode, quint32 *base, quint32 color, uchar alpha, int len);
+void compositeMask_avx2(int mode, quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip);
+void compositePixels_avx2(int mode, quint32 *base, const quint32 *over, int len, uchar opacity);
+void compositeColor_avx2(int mode, quint32 *base, quint32 color, uchar alpha, int len);
+#endif
+
+namespace {
+
+typedef void (*CompositeMaskFunc)(int, quint32*, quint32, const uchar*, int, int, int, int);
+typedef void (*CompositePixelsFunc)(int, quint32*, const quint32*, int, uchar);
+typedef void (*CompositeColorFunc)(int, quint32*, quint32, uchar, int);
+
+struct RasterOpImpl {
+	const char *name;
+	CompositeMaskFunc mask;
+	CompositePixelsFunc pixels;
+	CompositeColorFunc color;
+};
+
+// Implementations in order of preference
+const RasterOpImpl RASTEROP_IMPLS[] = {
+#ifdef HAVE_X86_RASTEROPS
+	{ "avx2", compositeMask_avx2, compositePixels_avx2, compositeColor_avx2 },
+	{ "sse4.1", compositeMask_sse41, compositePixels_sse41, compositeColor_sse41 },
+	{ "sse2", compositeMask_sse2, compositePixels_sse2, compositeColor_sse2 },
+#endif
+	{ "generic", compositeMaskGeneric, compositePixelsGeneric, compositeColorGeneric }
+};
+const int RASTEROP_IMPL_COUNT = sizeof(RASTEROP_IMPLS) / sizeof(RasterOpImpl);
+
+bool cpuSupports(const char *name)
+{
+	const QByteArray n(name);
+	if(n == "generic")
+		return true;
+
+#ifdef HAVE_X86_RASTEROPS
+#if defined(__GNUC__)
+	__builtin_cpu_init();
+	if(n == "avx2")
+		return __builtin_cpu_supports("avx2");
+	else if(n == "sse4.1")
+		return __builtin_cpu_supports("sse4.1");
+	else if(n == "sse2")
+		return __builtin_cpu_supports("sse2");
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	const int maxleaf = info[0];
+	__cpuid(info, 1);
+	if(n == "sse2")
+		return info[3] & (1<<26);
+	else if(n == "sse4.1")
+		return info[2] & (1<<19);
+	else if(n == "avx2") {
+		// AVX2 requires OS support for saving the YMM registers as well
+		const bool osxsave = info[2] & (1<<27);
+		const bool avx = info[2] & (1<<28);
+		if(!osxsave || !avx || maxleaf < 7)
+			return false;
+		if((_xgetbv(0) & 6) != 6)
+			return false;
+		__cpuidex(info, 7, 0);
+		return info[1] & (1<<5);
+	}
+#endif
+#endif
+	return false;
+}
+
+const RasterOpImpl *selectImplementation(const QByteArray &name)
+{
+	for(int i=0;i<RASTEROP_IMPL_COUNT;++i) {
+		const RasterOpImpl &impl = RASTEROP_IMPLS[i];
+		if((name.isEmpty() || name == impl.name) && cpuSupports(impl.name))
+			return &impl;
+	}
+	return 0;
+}
+
+const RasterOpImpl *initialImplementation()
+{
+	// The implementation can be forced with an environment variable.
+	// This is mainly useful for testing and benchmarking.
+	const QByteArray forced = qgetenv("DRAWPILE_RASTEROP");
+	if(!forced.isEmpty()) {
+		const RasterOpImpl *impl = selectImplementation(forced);
+		if(impl)
+			return impl;
+		qWarning() << "Raster operation implementation" << forced << "not available!";
+	}
+
+	return selectImplementation(QByteArray());
+}
+
+const RasterOpImpl *currentImpl = initialImplementation();
+
+}
+
+void compositeMask(int mode, quint32 *base, quint32 color, const uchar *mask,
+		int w, int h, int maskskip, int baseskip)
+{
+	currentImpl->mask(mode, base, color, mask, w, h, maskskip, baseskip);
+}
+
+void compositePixels(int mode, quint32 *base, const quint32 *over, int len, uchar opacity)
+{
+	currentImpl->pixels(mode, base, over, len, opacity);
+}
+
+void compositeColor(int mode, quint32 *base, quint32 color, uchar alpha, int len)
+{
+	currentImpl->color(mode, base, color, alpha, len);
+}
+
+QString rasteropImplementation()
+{
+	return QString(currentImpl->name);
+}
+
+QStringList availableRasteropImplementations()
+{
+	QStringList impls;
+	for(int i=0;i<RASTEROP_IMPL_COUNT;++i)
+		if(cpuSupports(RASTEROP_IMPLS[i].name))
+			impls << RASTEROP_IMPLS[i].name;
+	return impls;
+}
+
+bool setRasteropImplementation(const QString &name)
+{
+	const RasterOpImpl *impl = selectImplementation(name.toLatin1());
+	if(!impl) {
+		qWarning() << "Raster operation implementation" << name << "not available!";
+		return false;
+	}
+	currentImpl = impl;
+	return true;
+}
+
 }
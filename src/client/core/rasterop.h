@@ -22,6 +22,8 @@
 
 #include <QString>
 
+class QStringList;
+
 namespace paintcore {
 
 static const int BLEND_MODES=10;
@@ -51,6 +53,45 @@ void compositeMask(int mode, quint32 *base, quint32 color, const uchar *mask, in
  */
 void compositePixels(int mode, quint32 *base, const quint32 *over, int len, uchar opacity);
 
+/**
+ * @brief Composite a constant color onto pixels
+ *
+ * This is equivalent to (and produces the same result as) compositeMask
+ * with a mask whose every value is alpha, but no mask buffer is needed.
+ * @param mode composition mode
+ * @param base pixels onto which the color is composited
+ * @param color ARGB color value
+ * @param alpha mask value
+ * @param len number of pixels
+ */
+void compositeColor(int mode, quint32 *base, quint32 color, uchar alpha, int len);
+
+/**
+ * @brief Get the name of the active compositing implementation
+ *
+ * The fastest implementation supported by the CPU is selected at startup.
+ * It can be overridden by setting the DRAWPILE_RASTEROP environment variable.
+ * All implementations produce bit-identical results.
+ */
+QString rasteropImplementation();
+
+/**
+ * @brief Get the list of compositing implementations supported by this CPU
+ *
+ * The list is in order of preference. The last one is always "generic",
+ * the plain C++ reference implementation.
+ */
+QStringList availableRasteropImplementations();
+
+/**
+ * @brief Select the compositing implementation to use
+ *
+ * This must not be called while compositing is in progress in another thread.
+ * @param name implementation name
+ * @return false if the implementation is not available
+ */
+bool setRasteropImplementation(const QString &name);
+
 /**
  * @brief Get the blending mode for the given SVG composite operation name
  * @return blending mode or -1 if operation is not supported
@@ -0,0 +1,111 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <immintrin.h>
+
+#include "rasterop_simd.h"
+
+namespace paintcore {
+
+namespace {
+
+struct Avx2 {
+	typedef __m256i V;
+	static const int N = 8;
+
+	static inline V zero() { return _mm256_setzero_si256(); }
+	static inline V set16(short x) { return _mm256_set1_epi16(x); }
+	static inline V set32(quint32 x) { return _mm256_set1_epi32(x); }
+
+	static inline V loadPixels(const quint32 *ptr) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr)); }
+	static inline void storePixels(quint32 *ptr, V v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(ptr), v); }
+	static inline V loadMask(const uchar *ptr)
+	{
+		const V m = _mm256_broadcastsi128_si256(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(ptr)));
+		return _mm256_shuffle_epi8(m, _mm256_set_epi8(
+			7,7,7,7, 6,6,6,6, 5,5,5,5, 4,4,4,4,
+			3,3,3,3, 2,2,2,2, 1,1,1,1, 0,0,0,0
+			));
+	}
+
+	static inline V unpackLo(V v) { return _mm256_unpacklo_epi8(v, _mm256_setzero_si256()); }
+	static inline V unpackHi(V v) { return _mm256_unpackhi_epi8(v, _mm256_setzero_si256()); }
+	static inline V pack(V lo, V hi) { return _mm256_packus_epi16(lo, hi); }
+
+	static inline V add16(V a, V b) { return _mm256_add_epi16(a, b); }
+	static inline V sub16(V a, V b) { return _mm256_sub_epi16(a, b); }
+	static inline V mullo16(V a, V b) { return _mm256_mullo_epi16(a, b); }
+	static inline V min16(V a, V b) { return _mm256_min_epu16(a, b); }
+	static inline V max16(V a, V b) { return _mm256_max_epu16(a, b); }
+	static inline V subs16(V a, V b) { return _mm256_subs_epu16(a, b); }
+	static inline V cmpeq16(V a, V b) { return _mm256_cmpeq_epi16(a, b); }
+	static inline V or_(V a, V b) { return _mm256_or_si256(a, b); }
+	static inline V srl1(V a) { return _mm256_srli_epi16(a, 1); }
+	static inline V srl8(V a) { return _mm256_srli_epi16(a, 8); }
+	static inline V sll8(V a) { return _mm256_slli_epi16(a, 8); }
+
+	static inline V select(V mask, V a, V b) { return _mm256_blendv_epi8(b, a, mask); }
+
+	static inline bool allSet(V mask) { return _mm256_movemask_epi8(mask) == -1; }
+
+	static inline V broadcastAlpha(V v)
+	{
+		return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(v, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+	}
+
+	static inline V alphaLanes()
+	{
+		return _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0);
+	}
+
+	static inline V divide(V n, V d, float max)
+	{
+		const V z = _mm256_setzero_si256();
+		const __m256 m = _mm256_set1_ps(max);
+		const __m256 qlo = _mm256_min_ps(_mm256_div_ps(
+			_mm256_cvtepi32_ps(_mm256_unpacklo_epi16(n, z)),
+			_mm256_cvtepi32_ps(_mm256_unpacklo_epi16(d, z))
+			), m);
+		const __m256 qhi = _mm256_min_ps(_mm256_div_ps(
+			_mm256_cvtepi32_ps(_mm256_unpackhi_epi16(n, z)),
+			_mm256_cvtepi32_ps(_mm256_unpackhi_epi16(d, z))
+			), m);
+		return _mm256_packus_epi32(_mm256_cvttps_epi32(qlo), _mm256_cvttps_epi32(qhi));
+	}
+};
+
+}
+
+void compositeMask_avx2(int mode, quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	SimdOps<Avx2>::compositeMask(mode, base, color, mask, w, h, maskskip, baseskip);
+}
+
+void compositePixels_avx2(int mode, quint32 *base, const quint32 *over, int len, uchar opacity)
+{
+	SimdOps<Avx2>::compositePixels(mode, base, over, len, opacity);
+}
+
+void compositeColor_avx2(int mode, quint32 *base, quint32 color, uchar alpha, int len)
+{
+	SimdOps<Avx2>::compositeColor(mode, base, color, alpha, len);
+}
+
+}
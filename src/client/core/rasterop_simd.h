@@ -0,0 +1,424 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef RASTEROP_SIMD_H
+#define RASTEROP_SIMD_H
+
+#include <QtGlobal>
+#include <cstring>
+
+/*
+ * Vectorized versions of the composition functions in rasterop.cpp.
+ *
+ * The kernels are written against a small set of vector primitives
+ * provided by a traits class. Each instruction set specific source file
+ * (rasterop_sse2.cpp, rasterop_sse41.cpp and rasterop_avx2.cpp) implements
+ * the traits and instantiates the kernels with its own compiler flags.
+ *
+ * All drawing must produce exactly the same result on every client,
+ * so these functions must be bit-identical with the scalar reference
+ * implementation. Color channels are processed as 16 bit integers, which
+ * is enough to hold the intermediate results of UINT8_MULT and UINT8_BLEND
+ * without overflow. The divisions are done in single precision floating
+ * point: both the numerator and the denominator are small integers that are
+ * exactly representable, and the quotients are never close enough to an
+ * integer boundary for the rounding of the division to affect truncation.
+ *
+ * Everything here has internal linkage, since the same templates are
+ * compiled with different instruction sets in each source file.
+ */
+
+namespace paintcore {
+
+namespace {
+
+/**
+ * Traits class interface:
+ *
+ * V                 - vector type
+ * N                 - number of pixels in a vector
+ * zero()            - all zero vector
+ * set16(x)          - all 16 bit lanes set to x
+ * set32(x)          - all 32 bit lanes set to x
+ * loadPixels(ptr)   - load N pixels
+ * storePixels(ptr, v) - store N pixels
+ * loadMask(ptr)     - load N mask values, each value repeated 4 times
+ *                     (The same as set32 for a constant mask)
+ * unpackLo/Hi(v)    - expand the low/high bytes of each 128 bit lane to 16 bits
+ * pack(lo, hi)      - inverse of unpackLo/Hi
+ * add16, sub16, mullo16, min16, max16, subs16, cmpeq16, or_
+ * srl1, srl8, sll8  - 16 bit shifts
+ * select(mask, a, b) - mask ? a : b
+ * allSet(mask)      - true if every bit of the mask is set
+ * broadcastAlpha(v) - copy the alpha channel of each pixel to the color channels
+ * alphaLanes()      - lane mask that is set for the alpha channels
+ * divide(n, d, max) - min(floor(n/d), max) for 16 bit lanes (d>0)
+ */
+template<class T>
+struct SimdOps {
+	typedef typename T::V V;
+
+	//! Vector version of UINT8_MULT
+	static inline V mult(V a, V b)
+	{
+		const V c = T::add16(T::mullo16(a, b), T::set16(0x80));
+		return T::srl8(T::add16(T::srl8(c), c));
+	}
+
+	//! Vector version of UINT8_BLEND (a*alpha + b*(1-alpha))
+	static inline V blend(V a, V b, V alpha)
+	{
+		const V c = T::add16(
+			T::add16(T::mullo16(a, alpha), T::mullo16(b, T::sub16(T::set16(255), alpha))),
+			T::set16(0x80)
+			);
+		return T::srl8(T::add16(T::srl8(c), c));
+	}
+
+	//! Vector version of UINT8_DIVIDE
+	static inline V divide(V a, V b)
+	{
+		return T::divide(T::add16(T::mullo16(a, T::set16(255)), T::srl1(b)), b, 255.0f);
+	}
+
+	// Blending operations. These must match the ones in rasterop.cpp
+	static inline V blendMultiply(V base, V blend)
+	{
+		return mult(base, blend);
+	}
+
+	static inline V blendDivide(V base, V blend)
+	{
+		return T::divide(
+			T::add16(T::sll8(base), T::srl1(blend)),
+			T::add16(blend, T::set16(1)),
+			255.0f
+			);
+	}
+
+	static inline V blendDarken(V base, V blend)
+	{
+		return T::min16(base, blend);
+	}
+
+	static inline V blendLighten(V base, V blend)
+	{
+		return T::max16(base, blend);
+	}
+
+	static inline V blendDodge(V base, V blend)
+	{
+		return T::divide(T::sll8(base), T::sub16(T::set16(256), blend), 255.0f);
+	}
+
+	static inline V blendBurn(V base, V blend)
+	{
+		return T::sub16(
+			T::set16(255),
+			T::divide(T::sll8(T::sub16(T::set16(255), base)), T::add16(blend, T::set16(1)), 255.0f)
+			);
+	}
+
+	static inline V blendAdd(V base, V blend)
+	{
+		return T::min16(T::add16(base, blend), T::set16(255));
+	}
+
+	static inline V blendSubtract(V base, V blend)
+	{
+		return T::subs16(base, blend);
+	}
+
+	//! A mask whose every value is the same
+	struct ConstMask {
+		explicit ConstMask(uchar v) : value(v) { }
+		uchar value;
+	};
+
+	static inline V loadMask(const uchar *mask, int x) { return T::loadMask(mask+x); }
+	static inline V loadMask(ConstMask mask, int) { return T::set32(mask.value * 0x01010101u); }
+
+	static inline void loadMaskTail(const uchar *mask, int x, int n, uchar *tmp) { memcpy(tmp, mask+x, n); }
+	static inline void loadMaskTail(ConstMask mask, int, int n, uchar *tmp) { memset(tmp, mask.value, n); }
+
+	static inline void nextMaskRow(const uchar *&mask, int len) { mask += len; }
+	static inline void nextMaskRow(ConstMask, int) { }
+
+	/**
+	 * Apply a per pixel operation to a masked area. The last pixels of
+	 * a row are processed through a zero padded temporary buffer.
+	 */
+	template<typename Mask, typename Op>
+	static inline void maskLoop(quint32 *base, Mask mask, int w, int h, int maskskip, int baseskip, Op op)
+	{
+		for(int y=0;y<h;++y) {
+			int x=0;
+			for(;x<=w-T::N;x+=T::N) {
+				const V d = T::loadPixels(base+x);
+				const V m = loadMask(mask, x);
+				T::storePixels(base+x, T::pack(
+					op(T::unpackLo(d), T::unpackLo(m)),
+					op(T::unpackHi(d), T::unpackHi(m))
+					));
+			}
+			if(x<w) {
+				const int n = w-x;
+				quint32 dtmp[T::N];
+				uchar mtmp[T::N];
+				memset(dtmp, 0, sizeof dtmp);
+				memset(mtmp, 0, sizeof mtmp);
+				memcpy(dtmp, base+x, n*4);
+				loadMaskTail(mask, x, n, mtmp);
+
+				const V d = T::loadPixels(dtmp);
+				const V m = T::loadMask(mtmp);
+				T::storePixels(dtmp, T::pack(
+					op(T::unpackLo(d), T::unpackLo(m)),
+					op(T::unpackHi(d), T::unpackHi(m))
+					));
+				memcpy(base+x, dtmp, n*4);
+			}
+			base += w + baseskip;
+			nextMaskRow(mask, w + maskskip);
+		}
+	}
+
+	/**
+	 * Apply a per pixel operation to two pixel arrays.
+	 */
+	template<typename Op>
+	static inline void pixelLoop(quint32 *base, const quint32 *over, int len, Op op)
+	{
+		int x=0;
+		for(;x<=len-T::N;x+=T::N) {
+			const V d = T::loadPixels(base+x);
+			const V s = T::loadPixels(over+x);
+			T::storePixels(base+x, T::pack(
+				op(T::unpackLo(d), T::unpackLo(s)),
+				op(T::unpackHi(d), T::unpackHi(s))
+				));
+		}
+		if(x<len) {
+			const int n = len-x;
+			quint32 dtmp[T::N];
+			quint32 stmp[T::N];
+			memset(dtmp, 0, sizeof dtmp);
+			memset(stmp, 0, sizeof stmp);
+			memcpy(dtmp, base+x, n*4);
+			memcpy(stmp, over+x, n*4);
+
+			const V d = T::loadPixels(dtmp);
+			const V s = T::loadPixels(stmp);
+			T::storePixels(dtmp, T::pack(
+				op(T::unpackLo(d), T::unpackLo(s)),
+				op(T::unpackHi(d), T::unpackHi(s))
+				));
+			memcpy(base+x, dtmp, n*4);
+		}
+	}
+
+	// Normal alpha blend
+	template<typename Mask>
+	static void alphaMaskBlend(quint32 *base, quint32 color, Mask mask, int w, int h, int maskskip, int baseskip)
+	{
+		const V src = T::unpackLo(T::set32(color));
+		const V alpha = T::alphaLanes();
+		const V c0 = T::zero();
+		const V c255 = T::set16(255);
+		const V opaque = T::select(alpha, c255, src);
+
+		maskLoop(base, mask, w, h, maskskip, baseskip, [=](V d, V m) {
+			// The usual case: blend colors and alpha
+			V r = T::select(alpha,
+				T::add16(m, mult(T::sub16(c255, m), d)),
+				blend(src, d, m)
+				);
+
+			// Special case: target is completely transparent, we can overwrite it.
+			r = T::select(T::cmpeq16(T::broadcastAlpha(d), c0), T::select(alpha, m, src), r);
+
+			// Special case: mask pixel is completely opaque
+			r = T::select(T::cmpeq16(m, c255), opaque, r);
+
+			// Special case: mask pixel is completely transparent
+			return T::select(T::cmpeq16(m, c0), d, r);
+		});
+	}
+
+	// Specialized pixel composition: erase alpha channel
+	template<typename Mask>
+	static void maskErase(quint32 *base, Mask mask, int w, int h, int maskskip, int baseskip)
+	{
+		const V alpha = T::alphaLanes();
+		maskLoop(base, mask, w, h, maskskip, baseskip, [=](V d, V m) {
+			return T::select(alpha, T::subs16(d, m), d);
+		});
+	}
+
+	// Specialized pixel composition: copy source without any blending
+	template<typename Mask>
+	static void maskCopy(quint32 *base, quint32 color, Mask mask, int w, int h, int maskskip, int baseskip)
+	{
+		const V src = T::unpackLo(T::set32(color));
+		maskLoop(base, mask, w, h, maskskip, baseskip, [=](V, V m) {
+			return mult(src, m);
+		});
+	}
+
+	// A generic composition function for special blending modes
+	// This doesn't touch the alpha channel.
+	template<V BO(V, V), typename Mask>
+	static void maskComposite(quint32 *base, quint32 color, Mask mask, int w, int h, int maskskip, int baseskip)
+	{
+		const V src = T::unpackLo(T::set32(color));
+		const V alpha = T::alphaLanes();
+		const V c0 = T::zero();
+		const V c255 = T::set16(255);
+
+		maskLoop(base, mask, w, h, maskskip, baseskip, [=](V d, V m) {
+			const V b = BO(d, src);
+
+			// The usual case: blending required
+			V r = T::select(alpha, d, blend(b, d, m));
+
+			// No need to do anything if destination pixel is fully transparent
+			r = T::select(T::cmpeq16(T::broadcastAlpha(d), c0), d, r);
+
+			// Special case: mask pixel is completely opaque
+			r = T::select(T::cmpeq16(m, c255), T::select(alpha, d, b), r);
+
+			// Special case: mask pixel is completely transparent
+			return T::select(T::cmpeq16(m, c0), d, r);
+		});
+	}
+
+	static void pixelAlphaBlend(quint32 *base, const quint32 *over, uchar opacity, int len)
+	{
+		const V alpha = T::alphaLanes();
+		const V o = T::set16(opacity);
+		const V c0 = T::zero();
+		const V c1 = T::set16(1);
+		const V c255 = T::set16(255);
+		const V colorLanes = T::cmpeq16(alpha, c0);
+
+		pixelLoop(base, over, len, [=](V d, V s) -> V {
+			const V a = mult(T::broadcastAlpha(s), o);
+
+			// Special case: all destination pixels are opaque.
+			// The result stays opaque and no division is needed.
+			if(T::allSet(T::or_(T::cmpeq16(d, c255), colorLanes)))
+				return T::select(alpha, d, T::add16(mult(a, s), mult(T::sub16(c255, a), d)));
+
+			const V a2 = mult(T::broadcastAlpha(d), T::sub16(c255, a));
+			const V a_out = T::add16(a, a2);
+
+			// Avoid division by zero. The result is discarded in that case anyway
+			const V div = T::max16(a_out, c1);
+
+			const V r = T::select(alpha,
+				a_out,
+				divide(T::add16(mult(a, s), mult(a2, d)), div)
+				);
+
+			return T::select(T::cmpeq16(a_out, c0), d, r);
+		});
+	}
+
+	// Specialized pixel composition: erase alpha channel
+	static void pixelErase(quint32 *base, const quint32 *over, uchar opacity, int len)
+	{
+		const V alpha = T::alphaLanes();
+		const V o = T::set16(opacity);
+		pixelLoop(base, over, len, [=](V d, V s) {
+			return T::select(alpha, T::subs16(d, mult(s, o)), d);
+		});
+	}
+
+	template<V BO(V, V)>
+	static void pixelComposite(quint32 *base, const quint32 *over, uchar opacity, int len)
+	{
+		const V alpha = T::alphaLanes();
+		const V o = T::set16(opacity);
+		const V c0 = T::zero();
+
+		pixelLoop(base, over, len, [=](V d, V s) {
+			const V da = T::broadcastAlpha(d);
+			const V sa = T::broadcastAlpha(s);
+			const V a2 = mult(mult(sa, o), da);
+
+			// The usual case: blending required
+			const V r = T::select(alpha, d, blend(BO(d, s), d, a2));
+
+			// Special case: source or destination pixel is completely transparent
+			return T::select(T::or_(T::cmpeq16(sa, c0), T::cmpeq16(da, c0)), d, r);
+		});
+	}
+
+	template<typename Mask>
+	static void composite(int mode, quint32 *base, quint32 color, Mask mask, int w, int h, int maskskip, int baseskip)
+	{
+		// Note! Make sure the these are in the correct order!
+		switch(mode) {
+		case 0: maskErase(base, mask, w, h, maskskip, baseskip); break;
+		case 1: alphaMaskBlend(base, color, mask, w, h, maskskip, baseskip); break;
+		case 2: maskComposite<blendMultiply>(base, color, mask, w, h, maskskip, baseskip); break;
+		case 3: maskComposite<blendDivide>(base, color, mask, w, h, maskskip, baseskip); break;
+		case 4: maskComposite<blendBurn>(base, color, mask, w, h, maskskip, baseskip); break;
+		case 5: maskComposite<blendDodge>(base, color, mask, w, h, maskskip, baseskip); break;
+		case 6: maskComposite<blendDarken>(base, color, mask, w, h, maskskip, baseskip); break;
+		case 7: maskComposite<blendLighten>(base, color, mask, w, h, maskskip, baseskip); break;
+		case 8: maskComposite<blendSubtract>(base, color, mask, w, h, maskskip, baseskip); break;
+		case 9: maskComposite<blendAdd>(base, color, mask, w, h, maskskip, baseskip); break;
+		case 255: maskCopy(base, color, mask, w, h, maskskip, baseskip); break;
+		}
+	}
+
+	static void compositeMask(int mode, quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+	{
+		composite(mode, base, color, mask, w, h, maskskip, baseskip);
+	}
+
+	static void compositeColor(int mode, quint32 *base, quint32 color, uchar alpha, int len)
+	{
+		composite(mode, base, color, ConstMask(alpha), len, 1, 0, 0);
+	}
+
+	static void compositePixels(int mode, quint32 *base, const quint32 *over, int len, uchar opacity)
+	{
+		// Note! Make sure the these are in the correct order!
+		switch(mode) {
+		case 0: pixelErase(base, over, opacity, len); break;
+		case 1: pixelAlphaBlend(base, over, opacity, len); break;
+		case 2: pixelComposite<blendMultiply>(base, over, opacity, len); break;
+		case 3: pixelComposite<blendDivide>(base, over, opacity, len); break;
+		case 4: pixelComposite<blendBurn>(base, over, opacity, len); break;
+		case 5: pixelComposite<blendDodge>(base, over, opacity, len); break;
+		case 6: pixelComposite<blendDarken>(base, over, opacity, len); break;
+		case 7: pixelComposite<blendLighten>(base, over, opacity, len); break;
+		case 8: pixelComposite<blendSubtract>(base, over, opacity, len); break;
+		case 9: pixelComposite<blendAdd>(base, over, opacity, len); break;
+		}
+	}
+};
+
+}
+
+}
+
+#endif
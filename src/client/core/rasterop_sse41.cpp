@@ -0,0 +1,106 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <smmintrin.h>
+
+#include "rasterop_simd.h"
+
+namespace paintcore {
+
+namespace {
+
+struct Sse41 {
+	typedef __m128i V;
+	static const int N = 4;
+
+	static inline V zero() { return _mm_setzero_si128(); }
+	static inline V set16(short x) { return _mm_set1_epi16(x); }
+	static inline V set32(quint32 x) { return _mm_set1_epi32(x); }
+
+	static inline V loadPixels(const quint32 *ptr) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr)); }
+	static inline void storePixels(quint32 *ptr, V v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(ptr), v); }
+	static inline V loadMask(const uchar *ptr)
+	{
+		int m;
+		memcpy(&m, ptr, 4);
+		return _mm_shuffle_epi8(_mm_cvtsi32_si128(m), _mm_set_epi8(3,3,3,3, 2,2,2,2, 1,1,1,1, 0,0,0,0));
+	}
+
+	static inline V unpackLo(V v) { return _mm_cvtepu8_epi16(v); }
+	static inline V unpackHi(V v) { return _mm_unpackhi_epi8(v, _mm_setzero_si128()); }
+	static inline V pack(V lo, V hi) { return _mm_packus_epi16(lo, hi); }
+
+	static inline V add16(V a, V b) { return _mm_add_epi16(a, b); }
+	static inline V sub16(V a, V b) { return _mm_sub_epi16(a, b); }
+	static inline V mullo16(V a, V b) { return _mm_mullo_epi16(a, b); }
+	static inline V min16(V a, V b) { return _mm_min_epu16(a, b); }
+	static inline V max16(V a, V b) { return _mm_max_epu16(a, b); }
+	static inline V subs16(V a, V b) { return _mm_subs_epu16(a, b); }
+	static inline V cmpeq16(V a, V b) { return _mm_cmpeq_epi16(a, b); }
+	static inline V or_(V a, V b) { return _mm_or_si128(a, b); }
+	static inline V srl1(V a) { return _mm_srli_epi16(a, 1); }
+	static inline V srl8(V a) { return _mm_srli_epi16(a, 8); }
+	static inline V sll8(V a) { return _mm_slli_epi16(a, 8); }
+
+	static inline V select(V mask, V a, V b) { return _mm_blendv_epi8(b, a, mask); }
+
+	static inline bool allSet(V mask) { return _mm_movemask_epi8(mask) == 0xffff; }
+
+	static inline V broadcastAlpha(V v)
+	{
+		return _mm_shuffle_epi8(v, _mm_set_epi8(15,14,15,14,15,14,15,14, 7,6,7,6,7,6,7,6));
+	}
+
+	static inline V alphaLanes() { return _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0); }
+
+	static inline V divide(V n, V d, float max)
+	{
+		const V z = _mm_setzero_si128();
+		const __m128 m = _mm_set1_ps(max);
+		const __m128 qlo = _mm_min_ps(_mm_div_ps(
+			_mm_cvtepi32_ps(_mm_cvtepu16_epi32(n)),
+			_mm_cvtepi32_ps(_mm_cvtepu16_epi32(d))
+			), m);
+		const __m128 qhi = _mm_min_ps(_mm_div_ps(
+			_mm_cvtepi32_ps(_mm_unpackhi_epi16(n, z)),
+			_mm_cvtepi32_ps(_mm_unpackhi_epi16(d, z))
+			), m);
+		return _mm_packus_epi32(_mm_cvttps_epi32(qlo), _mm_cvttps_epi32(qhi));
+	}
+};
+
+}
+
+void compositeMask_sse41(int mode, quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	SimdOps<Sse41>::compositeMask(mode, base, color, mask, w, h, maskskip, baseskip);
+}
+
+void compositePixels_sse41(int mode, quint32 *base, const quint32 *over, int len, uchar opacity)
+{
+	SimdOps<Sse41>::compositePixels(mode, base, over, len, opacity);
+}
+
+void compositeColor_sse41(int mode, quint32 *base, quint32 color, uchar alpha, int len)
+{
+	SimdOps<Sse41>::compositeColor(mode, base, color, alpha, len);
+}
+
+}
@@ -0,0 +1,153 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <QtConcurrent>
+
+#include "renderworker.h"
+#include "tilepyramid.h"
+#include "tile.h"
+
+namespace paintcore {
+
+namespace {
+
+/**
+ * Publish a batch of items. Only one thread may post to a box.
+ *
+ * An unclaimed batch is taken back and the new items are appended to it.
+ * The consumer may swap the box empty at any time, so this never waits.
+ */
+template<typename T> void post(QAtomicPointer< QList<T> > &box, const QList<T> &items)
+{
+	QList<T> *batch = box.fetchAndStoreAcquire(0);
+	if(batch)
+		batch->append(items);
+	else
+		batch = new QList<T>(items);
+
+	QList<T> *old = box.fetchAndStoreRelease(batch);
+	Q_ASSERT(!old);
+	Q_UNUSED(old);
+}
+
+//! Claim the published batch
+template<typename T> QList<T> take(QAtomicPointer< QList<T> > &box)
+{
+	QList<T> *batch = box.fetchAndStoreAcquire(0);
+	if(!batch)
+		return QList<T>();
+
+	const QList<T> items = *batch;
+	delete batch;
+	return items;
+}
+
+RenderResult render(const RenderJob &job, FlattenCache *cache)
+{
+	RenderResult result;
+	result.level = job.level;
+	result.x = job.x;
+	result.y = job.y;
+	result.generation = job.generation;
+
+	if(job.level==0) {
+		// The flattened tiles are normally fully opaque, since they are composited
+		// on top of the checkerboard background. Straight and premultiplied alpha are
+		// identical then, so the tiles can be uploaded without format conversion.
+		// Only the erase blending mode can make holes in the result.
+		result.image = QImage(Tile::SIZE, Tile::SIZE, job.erase ? QImage::Format_ARGB32 : QImage::Format_ARGB32_Premultiplied);
+
+		const TileSnapshot &ts = job.tiles.at(0);
+		result.rect = ts.flatten(reinterpret_cast<quint32*>(result.image.bits()), job.rect,
+			cache, ts.yindex() * job.xtiles + ts.xindex());
+
+	} else {
+		result.image = TilePyramid::emptyTile();
+
+		quint32 data[Tile::LENGTH];
+		for(int q=0;q<job.tiles.size();++q) {
+			const TileSnapshot &ts = job.tiles.at(q);
+			if(ts.isNull())
+				continue;
+
+			ts.flatten(data, QRect(0, 0, Tile::SIZE, Tile::SIZE), cache, ts.yindex() * job.xtiles + ts.xindex());
+			if(job.erase) {
+				for(int i=0;i<Tile::LENGTH;++i)
+					data[i] = qPremultiply(data[i]);
+			}
+			TilePyramid::downscale(data, result.image, q);
+		}
+	}
+
+	return result;
+}
+
+}
+
+RenderWorker::RenderWorker(FlattenCache *cache, QObject *parent)
+	: QThread(parent), _cache(cache), _jobs(0), _results(0), _quit(0)
+{
+}
+
+RenderWorker::~RenderWorker()
+{
+	_quit.store(1);
+	_wakeup.release();
+	wait();
+
+	delete _jobs.fetchAndStoreAcquire(0);
+	delete _results.fetchAndStoreAcquire(0);
+}
+
+void RenderWorker::submit(const QList<RenderJob> &jobs)
+{
+	if(jobs.isEmpty())
+		return;
+
+	post(_jobs, jobs);
+	_wakeup.release();
+}
+
+QList<RenderResult> RenderWorker::takeResults()
+{
+	return take(_results);
+}
+
+void RenderWorker::run()
+{
+	forever {
+		_wakeup.acquire();
+		if(_quit.load())
+			break;
+
+		const QList<RenderJob> jobs = take(_jobs);
+		if(jobs.isEmpty())
+			continue;
+
+		const QList<RenderResult> results = QtConcurrent::blockingMapped< QList<RenderResult> >(jobs, [this](const RenderJob &job) {
+			return render(job, _cache);
+		});
+
+		post(_results, results);
+		emit rendered();
+	}
+}
+
+}
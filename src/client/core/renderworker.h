@@ -0,0 +1,120 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef PAINTCORE_RENDERWORKER_H
+#define PAINTCORE_RENDERWORKER_H
+
+#include <QThread>
+#include <QSemaphore>
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QImage>
+#include <QList>
+
+#include "tilesnapshot.h"
+
+namespace paintcore {
+
+class FlattenCache;
+
+//! A tile to be rendered in the background
+struct RenderJob {
+	RenderJob() : level(0), x(-1), y(-1), xtiles(0), erase(false), generation(0) { }
+
+	//! 0 for a full size tile, 1 for a tile of the first pyramid level
+	int level;
+
+	//! Tile coordinates at the given level
+	int x, y;
+
+	//! The part of the tile to update (full size tiles only)
+	QRect rect;
+
+	//! Snapshot of the tile (level 0) or the four tiles under it (level 1, null if outside the canvas)
+	QVector<TileSnapshot> tiles;
+
+	//! Width of the canvas in tiles (needed to index the flattening cache)
+	int xtiles;
+
+	//! Are there erase mode layers? (The result may then contain transparent pixels)
+	bool erase;
+
+	//! Canvas generation the snapshots were taken from
+	int generation;
+};
+
+//! A rendered tile
+struct RenderResult {
+	RenderResult() : level(0), x(-1), y(-1), generation(0) { }
+
+	int level;
+	int x, y;
+
+	//! The part of the tile that was rendered (full size tiles only)
+	QRect rect;
+
+	//! Flattened tile, or a premultiplied pyramid tile
+	QImage image;
+
+	int generation;
+};
+
+/**
+ * @brief Background thread for flattening tiles
+ *
+ * The GUI thread submits snapshots of the tiles that need to be redrawn
+ * and picks up the finished tiles when rendered() is emitted. Painting
+ * never has to wait for the layers to be composited.
+ *
+ * Jobs and results are handed over in batches: the producer fills a
+ * batch of its own and publishes it with an atomic pointer swap.
+ * If the previous batch hasn't been picked up yet, the producer
+ * swaps it back and appends to it. Neither side blocks the other.
+ */
+class RenderWorker : public QThread {
+	Q_OBJECT
+public:
+	explicit RenderWorker(FlattenCache *cache, QObject *parent=0);
+	~RenderWorker();
+
+	//! Queue jobs for rendering. Must be called from the GUI thread.
+	void submit(const QList<RenderJob> &jobs);
+
+	//! Take the finished tiles. Must be called from the GUI thread.
+	QList<RenderResult> takeResults();
+
+signals:
+	//! New results are available
+	void rendered();
+
+protected:
+	void run();
+
+private:
+	FlattenCache *_cache;
+
+	QAtomicPointer< QList<RenderJob> > _jobs;
+	QAtomicPointer< QList<RenderResult> > _results;
+	QSemaphore _wakeup;
+	QAtomicInt _quit;
+};
+
+}
+
+#endif
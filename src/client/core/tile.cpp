@@ -21,24 +21,101 @@
 #include <QDebug>
 #include <QImage>
 #include <QPainter>
+#include <QMutex>
+#include <QHash>
+#include <QAtomicInteger>
 
 #include "tile.h"
+#include "tilepool.h"
 #include "rasterop.h"
 
 namespace paintcore {
 
+namespace {
+
+// Tile interning table.
+// The table does not own the data: entries are removed when the data is deleted.
+QMutex internLock;
+QHash<quint64, TileData*> internTable;
+QAtomicInt internEnabled;
+int internHits;
+
+quint64 hashTileData(const quint32 *data)
+{
+	const quint64 *ptr = reinterpret_cast<const quint64*>(data);
+	const quint64 *end = ptr + Tile::BYTES / sizeof(quint64);
+	quint64 h = Q_UINT64_C(0xcbf29ce484222325);
+	while(ptr<end) {
+		h = (h ^ *(ptr++)) * Q_UINT64_C(0x9e3779b97f4a7c15);
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+// Increment reference count, unless the data is already being deleted
+bool refIfAlive(TileData *d)
+{
+	int r = d->ref.load();
+	while(r>0) {
+		if(d->ref.testAndSetOrdered(r, r+1))
+			return true;
+		r = d->ref.load();
+	}
+	return false;
+}
+
+// Tile content revision numbers.
+// 64 bits wide, so the counter never wraps around and an old
+// revision number can't come back to match different content.
+QAtomicInteger<quint64> revisionCounter;
+
+quint64 nextRevision()
+{
+	return revisionCounter.fetchAndAddRelaxed(1);
+}
+
+}
+
+TileData::TileData()
+	: flags(0), revision(nextRevision()), interned(0)
+{
+}
+
+TileData::TileData(const TileData &other)
+	: QSharedData(other), flags(0), revision(nextRevision()), interned(0)
+{
+	memcpy(data, other.data, sizeof data);
+}
+
+TileData::~TileData()
+{
+	if(interned.load()) {
+		QMutexLocker lock(&internLock);
+		if(internTable.value(hash) == this)
+			internTable.remove(hash);
+	}
+}
+
+void *TileData::operator new(size_t size)
+{
+	Q_ASSERT(size == sizeof(TileData));
+	Q_UNUSED(size);
+	return TilePool::allocate();
+}
+
+void TileData::operator delete(void *ptr)
+{
+	TilePool::release(ptr);
+}
+
 Tile::Tile() :
-	_data(0)
+	_data(0), _compressedRevision(0), _solid(0)
 {
 }
 
 Tile::Tile(const QColor& color)
-	: _data(new TileData)
+	: _data(0), _compressedRevision(0), _solid(color.rgba())
 {
-	quint32 *ptr = _data->data;
-	quint32 col = color.rgba();
-	for(int i=0;i<SIZE*SIZE;++i)
-		*(ptr++) = col;
 }
 
 /**
@@ -52,7 +129,7 @@ Tile::Tile(const QColor& color)
  * @param yoff source image offset
  */
 Tile::Tile(const QImage& image, int xoff, int yoff)
-	: _data(new TileData)
+	: _data(new TileData), _compressedRevision(0), _solid(0)
 {
 	Q_ASSERT(xoff>=0 && xoff < image.width());
 	Q_ASSERT(yoff>=0 && yoff < image.height());
@@ -96,26 +173,43 @@ void Tile::fillChecker(const QColor& dark, const QColor& light)
 
 void Tile::fillColor(const QColor& color)
 {
-	const quint32 c = color.rgba();
-	quint32 *ptr = getOrCreateUninitializedData();
-	for(int i=0;i<LENGTH;++i)
-		*(ptr++) = c;
+	_data = 0;
+	_compressed = QByteArray();
+	_solid = color.rgba();
 }
 
 void Tile::makeBlank()
 {
 	_data = 0;
+	_compressed = QByteArray();
+	_solid = 0;
 }
 
 void Tile::copyTo(quint32 *data) const
 {
+	if(isCompressed()) {
+		Tile t(*this);
+		t.decompress();
+		t.copyTo(data);
+		return;
+	}
+
 	if(isNull())
 		memset(data, 0, BYTES);
+	else if(isSolid())
+		fillBuffer(data, LENGTH, _solid);
 	else
 		memcpy(data, _data->data, BYTES);
 }
 
 void Tile::copyToImage(QImage& image, int x, int y) const {
+	if(isCompressed()) {
+		Tile t(*this);
+		t.decompress();
+		t.copyToImage(image, x, y);
+		return;
+	}
+
 	int w = 4*(image.width()-x<SIZE ? image.width()-x : SIZE);
 	int h = image.height()-y<SIZE ? image.height()-y : SIZE;
 	uchar *targ = image.bits() + y * image.bytesPerLine() + x * 4;
@@ -125,6 +219,11 @@ void Tile::copyToImage(QImage& image, int x, int y) const {
 			memset(targ, 0, w);
 			targ += image.bytesPerLine();
 		}
+	} else if(isSolid()) {
+		for(int y=0;y<h;++y) {
+			fillBuffer(reinterpret_cast<quint32*>(targ), w/4, _solid);
+			targ += image.bytesPerLine();
+		}
 	} else {
 		const quint32 *ptr = _data->data;
 		for(int y=0;y<h;++y) {
@@ -152,6 +251,66 @@ void Tile::composite(int mode, const uchar *values, const QColor& color, int x,
 			color.rgba(), values, w, h, skip, SIZE-w);
 }
 
+/**
+ * This is the same as calling composite() with a mask whose every value
+ * is alpha. When the whole tile is covered, solid tiles stay solid and
+ * the copy mode turns the tile into a solid tile.
+ *
+ * @param mode blending mode
+ * @param color composite color
+ * @param alpha mask value
+ * @param rect the area to composite (in tile coordinates)
+ */
+void Tile::compositeColor(int mode, const QColor& color, uchar alpha, const QRect &rect)
+{
+	Q_ASSERT(QRect(0, 0, SIZE, SIZE).contains(rect));
+	if(rect.isEmpty())
+		return;
+
+	if(rect.width() == SIZE && rect.height() == SIZE && (mode==255 || isSolid())) {
+		// The result is uniformly colored
+		quint32 c = mode==255 ? 0 : _solid;
+		paintcore::compositeColor(mode, &c, color.rgba(), alpha, 1);
+		_data = 0;
+		_compressed = QByteArray();
+		_solid = c;
+		return;
+	}
+
+	quint32 *ptr = getOrCreateData() + rect.y() * SIZE + rect.x();
+	if(rect.width() == SIZE) {
+		paintcore::compositeColor(mode, ptr, color.rgba(), alpha, rect.height() * SIZE);
+	} else {
+		for(int y=0;y<rect.height();++y,ptr+=SIZE)
+			paintcore::compositeColor(mode, ptr, color.rgba(), alpha, rect.width());
+	}
+}
+
+/**
+ * @param image the source image (must be in ARGB32 format)
+ * @param x source image coordinate corresponding to the top-left corner of rect
+ * @param y source image coordinate corresponding to the top-left corner of rect
+ * @param rect the area of this tile to replace (in tile coordinates)
+ * @param blend alpha blend the image pixels instead of copying them
+ */
+void Tile::putImage(const QImage &image, int x, int y, const QRect &rect, bool blend)
+{
+	Q_ASSERT(image.format() == QImage::Format_ARGB32);
+	Q_ASSERT(QRect(0, 0, SIZE, SIZE).contains(rect));
+	Q_ASSERT(QRect(0, 0, image.width(), image.height()).contains(QRect(x, y, rect.width(), rect.height())));
+	if(rect.isEmpty())
+		return;
+
+	quint32 *dest = getOrCreateData() + rect.y() * SIZE + rect.x();
+	for(int row=0;row<rect.height();++row,dest+=SIZE) {
+		const quint32 *src = reinterpret_cast<const quint32*>(image.constScanLine(y + row)) + x;
+		if(blend)
+			compositePixels(1, dest, src, rect.width(), 255);
+		else
+			memcpy(dest, src, rect.width() * sizeof(quint32));
+	}
+}
+
 /**
  * @param tile the tile which will be composited over this tile
  * @param opacity opacity modifier of tile
@@ -159,46 +318,366 @@ void Tile::composite(int mode, const uchar *values, const QColor& color, int x,
  */
 void Tile::merge(const Tile &tile, uchar opacity, int blend)
 {
-	if(!tile.isNull())
-		compositePixels(blend, getOrCreateData(), tile.data(), SIZE*SIZE, opacity);
+	if(tile.isNull())
+		return;
+
+	if(isSolid() && tile.isSolid()) {
+		// Two solid tiles: the result is also solid
+		quint32 c = _solid;
+		compositePixels(blend, &c, &tile._solid, 1, opacity);
+		_solid = c;
+
+	} else {
+		tile.mergeTo(getOrCreateData(), opacity, blend);
+	}
 }
 
 /**
- * @return true if every pixel of this tile has an alpha value of zero
+ * @param data the pixel buffer onto which this tile will be composited
+ * @param opacity opacity modifier of this tile
+ * @param blend blending mode
  */
-bool Tile::isBlank() const
+void Tile::mergeTo(quint32 *data, uchar opacity, int blend) const
 {
 	if(isNull())
-		return true;
+		return;
+
+	if(isCompressed()) {
+		Tile t(*this);
+		t.decompress();
+		t.mergeTo(data, opacity, blend);
+		return;
+	}
+
+	if(isSolid()) {
+		// Composite row by row, to avoid expanding the whole tile
+		quint32 row[SIZE];
+		fillBuffer(row, SIZE, _solid);
+		for(int y=0;y<SIZE;++y)
+			compositePixels(blend, data + y*SIZE, row, SIZE, opacity);
+
+	} else {
+		compositePixels(blend, data, _data->data, LENGTH, opacity);
+	}
+}
+
+/**
+ * @param data the pixel buffer onto which this tile will be composited
+ * @param opacity opacity modifier of this tile
+ * @param blend blending mode
+ * @param rect the area to composite (in tile coordinates)
+ */
+void Tile::mergeTo(quint32 *data, uchar opacity, int blend, const QRect &rect) const
+{
+	Q_ASSERT(QRect(0, 0, SIZE, SIZE).contains(rect));
+
+	if(rect.width() == SIZE && rect.height() == SIZE) {
+		mergeTo(data, opacity, blend);
+		return;
+	}
+
+	if(isNull() || rect.isEmpty())
+		return;
+
+	if(isCompressed()) {
+		Tile t(*this);
+		t.decompress();
+		t.mergeTo(data, opacity, blend, rect);
+		return;
+	}
+
+	const int offset = rect.y() * SIZE + rect.x();
+
+	if(isSolid()) {
+		quint32 row[SIZE];
+		fillBuffer(row, rect.width(), _solid);
+		for(int y=0;y<rect.height();++y)
+			compositePixels(blend, data + offset + y*SIZE, row, rect.width(), opacity);
+
+	} else if(rect.width() == SIZE) {
+		// Full rows are contiguous
+		compositePixels(blend, data + offset, _data->data + offset, rect.height() * SIZE, opacity);
+
+	} else {
+		for(int y=0;y<rect.height();++y)
+			compositePixels(blend, data + offset + y*SIZE, _data->data + offset + y*SIZE, rect.width(), opacity);
+	}
+}
 
-	const quint32 *pixel = _data->data;
-	const quint32 *end = pixel + SIZE*SIZE;
+/**
+ * Get the opaque/transparent summary flags of this tile.
+ *
+ * The summary of pixel data is calculated on first use and cached until
+ * the data is modified. (The cache is reset in getOrCreateData.)
+ */
+int Tile::summary() const
+{
+	if(isCompressed()) {
+		Tile t(*this);
+		t.decompress();
+		return t.summary();
+	}
+
+	if(isSolid()) {
+		const int a = qAlpha(_solid);
+		return KNOWN | (a==255 ? OPAQUE : 0) | (a==0 ? TRANSPARENT : 0);
+	}
+
+	int flags = _data->flags.load();
+	if(!flags) {
+		quint32 alphaAnd = 0xff000000;
+		quint32 alphaOr = 0;
+		const quint32 *pixel = _data->data;
+		const quint32 *end = pixel + LENGTH;
+		while(pixel<end) {
+			alphaAnd &= *pixel;
+			alphaOr |= *pixel;
+			++pixel;
+		}
+
+		flags = KNOWN;
+		if(alphaAnd == 0xff000000)
+			flags |= OPAQUE;
+		if(!(alphaOr & 0xff000000))
+			flags |= TRANSPARENT;
+
+		_data->flags.store(flags);
+	}
+	return flags;
+}
+
+void Tile::optimize()
+{
+	// Tiles are optimized before they are compressed
+	if(isCompressed())
+		return;
+
+	if(isSolid()) {
+		if(qAlpha(_solid) == 0)
+			_solid = 0;
+		return;
+	}
+
+	if(isBlank()) {
+		makeBlank();
+		return;
+	}
+
+	// Replace uniformly colored pixel data with a solid color value.
+	// (Read through a const pointer, so shared data is not detached.)
+	const quint32 *pixel = _data.constData()->data;
+	const quint32 c = *pixel;
+	const quint32 *end = pixel + LENGTH;
 	while(pixel<end) {
-		if((*pixel & 0xff000000))
-			return false;
+		if(*pixel != c)
+			return;
 		++pixel;
 	}
-	return true;
+	_data = 0;
+	_solid = c;
 }
 
-void Tile::optimize()
+quint64 Tile::revision() const
 {
-	if(!isNull() && isBlank())
-		_data = 0;
+	// Compression does not change the content of the tile
+	if(isCompressed())
+		return _compressedRevision;
+
+	// Solid tiles are identified by their color. The top bit keeps these
+	// apart from the revisions of pixel data, which never get that high.
+	if(isSolid())
+		return (Q_UINT64_C(1) << 63) | _solid;
+
+	return _data->revision;
+}
+
+void Tile::fillBuffer(quint32 *data, int len, quint32 color)
+{
+	while(len--)
+		*(data++) = color;
+}
+
+/**
+ * Uncompress the pixel data of a compressed tile into a new data block.
+ * The revision number of the data is preserved, since decompression
+ * does not change the content of the tile.
+ */
+TileData *Tile::decompressedData() const
+{
+	Q_ASSERT(isCompressed());
+
+	const QByteArray raw = qUncompress(_compressed);
+
+	TileData *d = new TileData;
+	if(raw.size() == BYTES) {
+		memcpy(d->data, raw.constData(), BYTES);
+		d->revision = _compressedRevision;
+	} else {
+		qWarning() << "Couldn't decompress tile data!";
+		memset(d->data, 0, BYTES);
+	}
+	return d;
+}
+
+void Tile::decompress()
+{
+	if(!isCompressed())
+		return;
+
+	_data = decompressedData();
+	_compressed = QByteArray();
+}
+
+quint32 Tile::compressedPixel(int x, int y) const
+{
+	Tile t(*this);
+	t.decompress();
+	return t.pixel(x, y);
+}
+
+void Tile::intern()
+{
+	if(!_data || !internEnabled.load())
+		return;
+
+	// Interning only changes bookkeeping fields, not the tile content,
+	// so the shared data can be modified without detaching.
+	TileData *d = const_cast<TileData*>(_data.constData());
+	if(d->interned.load())
+		return;
+
+	const quint64 hash = hashTileData(d->data);
+
+	QMutexLocker lock(&internLock);
+
+	// Another tile sharing the data may have interned it meanwhile
+	if(d->interned.load())
+		return;
+
+	TileData *other = internTable.value(hash);
+	if(other) {
+		if(memcmp(other->data, d->data, BYTES) == 0 && refIfAlive(other)) {
+			// Identical tile found. (Our old data is never interned, so it
+			// can be released without touching the table.)
+			_data = QSharedDataPointer<TileData>(other);
+			other->ref.deref();
+			++internHits;
+			return;
+		}
+
+		// Hash collision or an entry that is being deleted: replace the old entry
+		other->interned.store(0);
+	}
+
+	d->hash = hash;
+	d->interned.store(1);
+	internTable[hash] = d;
+}
+
+void Tile::setInterning(bool enable)
+{
+	internEnabled.store(enable);
+}
+
+bool Tile::isInterning()
+{
+	return internEnabled.load();
+}
+
+Tile::InternStats Tile::internStats()
+{
+	QMutexLocker lock(&internLock);
+	InternStats s;
+	s.entries = internTable.size();
+	s.hits = internHits;
+
+	// Each reference beyond the first is a tile that would otherwise
+	// need its own copy of the data
+	s.shared = 0;
+	foreach(const TileData *d, internTable)
+		s.shared += d->ref.load() - 1;
+
+	return s;
+}
+
+/**
+ * Make sure the pixel data can be modified in place.
+ *
+ * Interned data must not be modified in place, since other tiles may
+ * pick it up from the intern table. If this is the only reference,
+ * the data is simply removed from the table. Otherwise a non-interned
+ * copy is made.
+ *
+ * The reference count check, the table removal and the copy are all done
+ * while holding the intern table lock. Otherwise another owner could drop
+ * its reference or intern the data in between, and the data would be
+ * modified in place while still in the table.
+ */
+void Tile::prepareWrite()
+{
+	TileData *d = const_cast<TileData*>(_data.constData());
+
+	// Data that is referenced only by this tile and is not in the
+	// intern table cannot be reached from other threads.
+	if(d->ref.load() == 1 && !d->interned.load())
+		return;
+
+	// The old data is released only after the lock has been released,
+	// since deleting interned data needs the lock too.
+	const QSharedDataPointer<TileData> old = _data;
+
+	QMutexLocker lock(&internLock);
+	if(d->ref.load() == 2) {
+		// Referenced only by this tile (and the temporary reference above)
+		if(d->interned.load()) {
+			if(internTable.value(d->hash) == d)
+				internTable.remove(d->hash);
+			d->interned.store(0);
+		}
+	} else {
+		_data = new TileData(*d);
+	}
 }
 
 quint32 *Tile::getOrCreateData() {
+	decompress();
+
+	if(_data)
+		prepareWrite();
+
 	if(!_data) {
+		// Expand solid color to pixel data
 		_data = new TileData;
-		memset(_data->data, 0, BYTES);
+		if(_solid)
+			fillBuffer(_data->data, LENGTH, _solid);
+		else
+			memset(_data->data, 0, BYTES);
+		_solid = 0;
 	}
-	return _data->data;
+
+	// The caller will modify the data
+	TileData *d = _data.data();
+	d->flags.store(0);
+	d->revision = nextRevision();
+	return d->data;
 }
 
 quint32 *Tile::getOrCreateUninitializedData() {
-	if(!_data)
+	// Old content will be overwritten, no need to decompress it
+	_compressed = QByteArray();
+
+	if(_data)
+		prepareWrite();
+
+	if(!_data) {
 		_data = new TileData;
-	return _data->data;
+		_solid = 0;
+	}
+
+	TileData *d = _data.data();
+	d->flags.store(0);
+	d->revision = nextRevision();
+	return d->data;
 }
 
 }
@@ -21,23 +21,56 @@
 #define TILE_H
 
 #include <QSharedDataPointer>
+#include <QByteArray>
+#include <QAtomicInt>
 
 class QColor;
 class QImage;
+class QRect;
 
 namespace paintcore {
 
 /// Shared tile data
 struct TileData : public QSharedData {
+	TileData();
+	TileData(const TileData &other);
+	~TileData();
+
 	quint32 data[64*64];
+
+	// Cached content summary (see Tile::isOpaque.) Zero if not yet known.
+	mutable QAtomicInt flags;
+
+	// Content revision number (see Tile::revision)
+	quint64 revision;
+
+	// Content hash and interning status. (A copy is never interned.)
+	// The hash is accessed only while holding the intern table lock.
+	quint64 hash;
+	QAtomicInt interned;
+
+	// Tile data is allocated from a memory pool (see tilepool.h)
+	static void *operator new(size_t size);
+	static void operator delete(void *ptr);
 };
 
 /**
  * @brief A piece of an image
  * Each tile is a square of size SIZE*SIZE. The pixel format is 32-bit ARGB.
  *
+ * A tile filled with a single color does not allocate any pixel data.
+ * The color is stored as a single value and the pixel data is allocated
+ * only when the tile is first modified.
+ *
+ * Tiles that are not in active use can be stored in compressed form
+ * (see TileCompressor.) Reading a compressed tile decompresses a temporary
+ * copy of the data, without changing the tile itself, so this is slow.
+ * Tiles that are going to be used (e.g. the tiles of a layer that was
+ * made visible) should be decompressed through the owning map with decompress().
  */
 class Tile {
+	friend class TileCompressor;
+	friend class TileCompressionJob;
 	public:
 		//! The tile width and height
 		static const int SIZE = 64;
@@ -80,7 +113,7 @@ class Tile {
 		//! Construct a null tile
 		Tile();
 
-		//! Construct a tile filled with the given color
+		//! Construct a tile filled with the given color (no pixel data is allocated)
 		Tile(const QColor& color);
 
 		//! Construct a tile from an image
@@ -92,15 +125,29 @@ class Tile {
 			Q_ASSERT(y>=0 && y<SIZE);
 			if(_data)
 				return *(_data->data + y * SIZE + x);
-			return 0;
+			if(!_compressed.isNull())
+				return compressedPixel(x, y);
+			return _solid;
 		}
 
 		//! Composite values multiplied by color onto this tile
 		void composite(int mode, const uchar *values, const QColor& color, int x, int y, int w, int h, int offset);
 
+		//! Composite a color with a constant alpha value onto a part of this tile
+		void compositeColor(int mode, const QColor& color, uchar alpha, const QRect &rect);
+
+		//! Copy or alpha blend a part of an image onto this tile
+		void putImage(const QImage &image, int x, int y, const QRect &rect, bool blend);
+
 		//! Composite another tile with this tile
 		void merge(const Tile &tile, uchar opacity, int blend);
 
+		//! Composite this tile onto a tile sized pixel buffer
+		void mergeTo(quint32 *data, uchar opacity, int blend) const;
+
+		//! Composite a part of this tile onto the same part of a tile sized pixel buffer
+		void mergeTo(quint32 *data, uchar opacity, int blend, const QRect &rect) const;
+
 		//! Copy the contents of this tile onto the given spot on an image
 		void copyToImage(QImage& image, int x, int y) const;
 
@@ -113,8 +160,11 @@ class Tile {
 		//! Make this a null tile
 		void makeBlank();
 
-		//! Get read access to the raw pixel data
-		const quint32 *data() const { Q_ASSERT( _data); return _data->data; }
+		/**
+		 * @brief Get read access to the raw pixel data
+		 * @pre !isSolid() && !isCompressed()
+		 */
+		const quint32 *data() const { Q_ASSERT(!isSolid() && !isCompressed()); return _data->data; }
 
 		//! Copy the contents of this tile
 		void copyTo(quint32 *data) const;
@@ -126,33 +176,128 @@ class Tile {
 		 * to be completely transparent.
 		 * @return true if there is no pixel data
 		 */
-		bool isNull() const { return !_data; }
+		bool isNull() const { return !_data && !_solid && _compressed.isNull(); }
+
+		/**
+		 * @brief Is this a uniformly colored tile without pixel data?
+		 *
+		 * Null tiles are solid tiles whose color value is zero.
+		 * @return true if there is no pixel data
+		 */
+		bool isSolid() const { return !_data && _compressed.isNull(); }
+
+		//! Get the color value of a solid tile
+		quint32 solidColor() const { Q_ASSERT(isSolid()); return _solid; }
+
+		//! Is the pixel data of this tile currently stored in compressed form?
+		bool isCompressed() const { return !_compressed.isNull(); }
+
+		/**
+		 * @brief Restore the pixel data of a compressed tile
+		 *
+		 * Other tiles sharing the same compressed data are not affected.
+		 * Does nothing if the tile is not compressed.
+		 */
+		void decompress();
+
+		/**
+		 * @brief Get the revision of this tile's content
+		 *
+		 * The revision changes whenever the tile is modified. Tiles
+		 * with the same revision have the same content. Unlike with
+		 * operator==, this remains true even after the original data
+		 * has been released.
+		 */
+		quint64 revision() const;
 
 		//! Check if this tile is completely transparent
-		bool isBlank() const;
+		bool isBlank() const { return summary() & TRANSPARENT; }
 
-		//! Make this a null tile if it is completely transparent
+		/**
+		 * @brief Check if every pixel of this tile is fully opaque
+		 *
+		 * The result is cached and recalculated only when the tile is
+		 * modified, so this is cheap to call repeatedly.
+		 */
+		bool isOpaque() const { return summary() & OPAQUE; }
+
+		//! Make this a null tile if it is completely transparent or a solid tile if it is uniformly colored
 		void optimize();
 
 		//! Fill a tile sized memory buffer with a checker pattenr
 		static void fillChecker(quint32 *data, const QColor& dark, const QColor& light);
 
+		/**
+		 * @brief Share pixel data with an identical tile, if one exists
+		 *
+		 * When interning is enabled, tile data is looked up from a table
+		 * by its content hash. If a tile with identical content is found,
+		 * its pixel data is shared with this tile. Otherwise this tile's
+		 * data is added to the table. Interned data is unshared
+		 * normally (copy on write) when modified.
+		 */
+		void intern();
+
+		//! Enable or disable tile interning
+		static void setInterning(bool enable);
+
+		//! Is tile interning enabled?
+		static bool isInterning();
+
+		struct InternStats {
+			//! Number of tiles in the intern table
+			int entries;
+
+			//! Number of tiles replaced with shared data since startup (cumulative)
+			int hits;
+
+			//! Number of extra references to the interned data right now
+			int shared;
+		};
+
+		//! Get the tile interning statistics
+		static InternStats internStats();
+
 		/**
 		 * @brief Return true if the two tiles point to the same data
 		 *
 		 * This is an identity comparison. This will return false even
 		 * if the tiles have identical contents but have different data pointers.
+		 * Solid tiles are equal if they have the same color.
 		 * @param other
 		 * @return true if tiles share data pointers
 		 */
-		bool operator==(const Tile &other) const { return _data == other._data; }
+		bool operator==(const Tile &other) const {
+			return _data == other._data && _solid == other._solid
+				&& _compressed.constData() == other._compressed.constData();
+		}
 		bool operator!=(const Tile &other) const { return !(*this == other); }
 
 	private:
+		enum {
+			KNOWN = 0x01,
+			OPAQUE = 0x02,
+			TRANSPARENT = 0x04
+		};
+
+		int summary() const;
+		static void fillBuffer(quint32 *data, int len, quint32 color);
+		TileData *decompressedData() const;
+		quint32 compressedPixel(int x, int y) const;
+		void prepareWrite();
 		quint32 *getOrCreateData();
 		quint32 *getOrCreateUninitializedData();
 
 		QSharedDataPointer<TileData> _data;
+
+		// Pixel data in compressed form (see TileCompressor)
+		QByteArray _compressed;
+
+		// Revision of the compressed pixel data
+		quint64 _compressedRevision;
+
+		// Color of the tile when there is no pixel data
+		quint32 _solid;
 };
 
 }
@@ -0,0 +1,143 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "tilebitmap.h"
+
+namespace paintcore {
+
+namespace {
+
+inline int countTrailingZeros(quint64 v)
+{
+	Q_ASSERT(v);
+#if defined(Q_CC_GNU) || defined(Q_CC_CLANG)
+	return __builtin_ctzll(v);
+#else
+	int n = 0;
+	while(!(v & 1)) {
+		v >>= 1;
+		++n;
+	}
+	return n;
+#endif
+}
+
+//! Get a word with bits [first..last] set
+inline quint64 bitRange(int first, int last)
+{
+	Q_ASSERT(first>=0 && first<=last && last<64);
+	const quint64 upto = last==63 ? ~quint64(0) : (quint64(1) << (last+1)) - 1;
+	return upto & ~((quint64(1) << first) - 1);
+}
+
+}
+
+TileBitmap::TileBitmap()
+	: _xtiles(0), _ytiles(0), _words(0)
+{
+}
+
+TileBitmap::TileBitmap(int xtiles, int ytiles)
+	: _xtiles(xtiles), _ytiles(ytiles), _words((xtiles+63) / 64),
+	  _bits(_words * ytiles, 0)
+{
+}
+
+void TileBitmap::set(const QRect &rect)
+{
+	const QRect r = rect & QRect(0, 0, _xtiles, _ytiles);
+	if(r.isEmpty())
+		return;
+
+	const int w0 = r.left() / 64;
+	const int w1 = r.right() / 64;
+	for(int y=r.top();y<=r.bottom();++y) {
+		quint64 *row = _bits.data() + y*_words;
+		for(int w=w0;w<=w1;++w)
+			row[w] |= bitRange(w==w0 ? r.left()%64 : 0, w==w1 ? r.right()%64 : 63);
+	}
+	_bounds |= r;
+}
+
+void TileBitmap::clearAll()
+{
+	if(_bounds.isEmpty())
+		return;
+	_bits.fill(0);
+	_bounds = QRect();
+}
+
+QVector<int> TileBitmap::indexes() const
+{
+	QVector<int> idx;
+	if(_bounds.isEmpty())
+		return idx;
+
+	const int w0 = _bounds.left() / 64;
+	const int w1 = _bounds.right() / 64;
+	for(int y=_bounds.top();y<=_bounds.bottom();++y) {
+		const quint64 *row = _bits.constData() + y*_words;
+		for(int w=w0;w<=w1;++w) {
+			quint64 bits = row[w];
+			while(bits) {
+				idx.append(y*_xtiles + w*64 + countTrailingZeros(bits));
+				bits &= bits - 1;
+			}
+		}
+	}
+	return idx;
+}
+
+void TileBitmap::unite(const TileBitmap &other)
+{
+	Q_ASSERT(other._xtiles == _xtiles && other._ytiles == _ytiles);
+	if(other._bounds.isEmpty())
+		return;
+
+	const QRect &b = other._bounds;
+	for(int y=b.top();y<=b.bottom();++y) {
+		for(int w=b.left()/64;w<=b.right()/64;++w)
+			_bits[y*_words + w] |= other._bits.at(y*_words + w);
+	}
+	_bounds |= b;
+}
+
+void TileBitmap::shrink()
+{
+	QRect bounds;
+	const int w0 = _bounds.left() / 64;
+	const int w1 = _bounds.right() / 64;
+	for(int y=_bounds.top();y<=_bounds.bottom();++y) {
+		const quint64 *row = _bits.constData() + y*_words;
+		for(int w=w0;w<=w1;++w) {
+			if(!row[w])
+				continue;
+			// Leftmost and rightmost set bits of this word
+			int first = countTrailingZeros(row[w]);
+			int last = 63;
+			while(!(row[w] & (quint64(1) << last)))
+				--last;
+			bounds |= QRect(w*64 + first, y, last-first+1, 1);
+		}
+	}
+	_bounds = bounds;
+}
+
+}
@@ -0,0 +1,117 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef PAINTCORE_TILEBITMAP_H
+#define PAINTCORE_TILEBITMAP_H
+
+#include <QVector>
+#include <QRect>
+
+namespace paintcore {
+
+/**
+ * @brief A set of tiles in a layer
+ *
+ * This is used to keep track of which tiles of a layer have content,
+ * so operations that are only interested in the non-empty tiles do not
+ * need to check every tile of the layer.
+ *
+ * There is one bit per tile, and a bounding box of the set bits.
+ * Looping through the set bits takes time proportional to the area of
+ * the bounding box divided by 64, rather than the number of tiles.
+ *
+ * The bounding box is not shrunk when bits are cleared. Call shrink()
+ * to recalculate it after clearing bits.
+ */
+class TileBitmap {
+public:
+	//! Construct an empty bitmap for a layer with no tiles
+	TileBitmap();
+
+	//! Construct an empty bitmap
+	TileBitmap(int xtiles, int ytiles);
+
+	//! Get the width of the bitmap in tiles
+	int xtiles() const { return _xtiles; }
+
+	//! Get the height of the bitmap in tiles
+	int ytiles() const { return _ytiles; }
+
+	//! Set the bit of a tile
+	void set(int index) {
+		Q_ASSERT(index>=0 && index<_xtiles*_ytiles);
+		set(index % _xtiles, index / _xtiles);
+	}
+
+	//! Set the bit of a tile
+	void set(int x, int y) {
+		Q_ASSERT(x>=0 && x<_xtiles && y>=0 && y<_ytiles);
+		_bits[y*_words + x/64] |= quint64(1) << (x%64);
+		_bounds |= QRect(x, y, 1, 1);
+	}
+
+	//! Set the bits of all tiles in a rectangle (in tile coordinates)
+	void set(const QRect &rect);
+
+	//! Set all bits
+	void setAll() { set(QRect(0, 0, _xtiles, _ytiles)); }
+
+	//! Clear the bit of a tile
+	void clear(int index) {
+		Q_ASSERT(index>=0 && index<_xtiles*_ytiles);
+		const int x = index % _xtiles;
+		_bits[(index / _xtiles)*_words + x/64] &= ~(quint64(1) << (x%64));
+	}
+
+	//! Clear all bits
+	void clearAll();
+
+	//! Check if the bit of a tile is set
+	bool test(int index) const {
+		Q_ASSERT(index>=0 && index<_xtiles*_ytiles);
+		const int x = index % _xtiles;
+		return _bits.at((index / _xtiles)*_words + x/64) & (quint64(1) << (x%64));
+	}
+
+	//! Are all the bits clear? (May return false if shrink() hasn't been called after clearing.)
+	bool isEmpty() const { return _bounds.isEmpty(); }
+
+	//! Get the bounding box of the set bits (in tile coordinates)
+	const QRect &bounds() const { return _bounds; }
+
+	//! Get the indexes of all set bits in ascending order
+	QVector<int> indexes() const;
+
+	//! Set the bits that are set in the other bitmap
+	void unite(const TileBitmap &other);
+
+	//! Recalculate the bounding box
+	void shrink();
+
+private:
+	int _xtiles;
+	int _ytiles;
+	int _words; // words per row
+	QVector<quint64> _bits;
+	QRect _bounds;
+};
+
+}
+
+#endif
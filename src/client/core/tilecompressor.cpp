@@ -0,0 +1,255 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <QAtomicInt>
+
+#include "tilecompressor.h"
+#include "layerstack.h"
+#include "layer.h"
+
+namespace paintcore {
+
+namespace {
+
+QAtomicInt compressionEnabled(1);
+qint64 savepointBudget = 64 * 1024 * 1024;
+
+// Use the fastest compression level. Cold tiles may need to be
+// decompressed while drawing, so speed matters more than size.
+static const int COMPRESSION_LEVEL = 1;
+
+// Tiles that don't shrink at least this much are left uncompressed
+static const int MAX_COMPRESSED_SIZE = Tile::BYTES * 3 / 4;
+
+}
+
+void TileCompressionJob::run()
+{
+	_compressed.resize(_tiles.size());
+	for(int i=0;i<_tiles.size();++i) {
+		const QByteArray c = qCompress(
+			reinterpret_cast<const uchar*>(_tiles.at(i)._data.constData()->data),
+			Tile::BYTES,
+			COMPRESSION_LEVEL
+		);
+
+		if(c.size() <= MAX_COMPRESSED_SIZE)
+			_compressed[i] = c;
+	}
+}
+
+TileCompressor::TileCompressor()
+	: _hotBytes(0), _budgetExceeded(false)
+{
+}
+
+void TileCompressor::setEnabled(bool enable)
+{
+	compressionEnabled.store(enable);
+}
+
+bool TileCompressor::isEnabled()
+{
+	return compressionEnabled.load();
+}
+
+void TileCompressor::setBudget(qint64 bytes)
+{
+	savepointBudget = bytes;
+}
+
+qint64 TileCompressor::budget()
+{
+	return savepointBudget;
+}
+
+/**
+ * Visible layers are always hot. Hidden layers are cold.
+ */
+void TileCompressor::addCanvas(LayerStack *stack)
+{
+	for(int i=0;i<stack->layers();++i) {
+		Layer *l = stack->getLayerByIndex(i);
+		addLayer(l, l->visible());
+	}
+}
+
+/**
+ * The newest savepoints are kept hot until the total size of
+ * their tile data exceeds the budget. Data shared with the
+ * canvas or newer savepoints is not counted again.
+ */
+void TileCompressor::addSavepoint(Savepoint *savepoint)
+{
+	bool hot = false;
+	if(!_budgetExceeded) {
+		QHash<const TileData*, bool> seen;
+		qint64 bytes = 0;
+		foreach(const Layer *l, savepoint->layers)
+			bytes += newHotBytes(l, seen);
+
+		if(_hotBytes + bytes <= savepointBudget) {
+			_hotBytes += bytes;
+			hot = true;
+		} else {
+			_budgetExceeded = true;
+		}
+	}
+
+	foreach(Layer *l, savepoint->layers)
+		addLayer(l, hot);
+}
+
+qint64 TileCompressor::newHotBytes(const Layer *layer, QHash<const TileData*, bool> &seen) const
+{
+	qint64 bytes = 0;
+	const TileMap &tiles = layer->tiles();
+	for(TileMap::const_iterator i=tiles.constBegin();i!=tiles.constEnd();++i) {
+		const TileData *d = i.value()._data.constData();
+		if(d && !_entries.value(d).hot && !seen.contains(d)) {
+			seen.insert(d, true);
+			bytes += Tile::BYTES;
+		}
+	}
+
+	foreach(const Layer *sl, layer->sublayers())
+		bytes += newHotBytes(sl, seen);
+
+	return bytes;
+}
+
+void TileCompressor::addLayer(Layer *layer, bool hot)
+{
+	foreach(Layer *sl, layer->_sublayers)
+		addLayer(sl, hot);
+
+	// Layer copies share their tile storage until modified, so the
+	// same tiles are typically found in many savepoints.
+	const TileMap &tiles = layer->_tiles;
+	const void *storage = tiles.storageId();
+	if(!storage)
+		return;
+
+	_maps[storage].append(&layer->_tiles);
+
+	bool countOwners = true;
+	QHash<const void*, bool>::iterator visited = _visited.find(storage);
+	if(visited != _visited.end()) {
+		if(visited.value() || !hot)
+			return;
+		// Already seen as cold, but the owners have been counted
+		visited.value() = true;
+		countOwners = false;
+	} else {
+		_visited.insert(storage, hot);
+	}
+
+	for(TileMap::const_iterator i=tiles.constBegin();i!=tiles.constEnd();++i) {
+		const Tile &t = i.value();
+		if(!t._data)
+			continue;
+
+		Entry &e = _entries[t._data.constData()];
+		if(countOwners) {
+			const Owner owner = { storage, i.key() };
+			e.owners.append(owner);
+		}
+		if(hot)
+			e.hot = true;
+	}
+}
+
+TileCompressionJob *TileCompressor::prepare() const
+{
+	TileCompressionJob *job = new TileCompressionJob;
+
+	QHashIterator<const TileData*, Entry> i(_entries);
+	while(i.hasNext()) {
+		i.next();
+		// Compress only if all references come from cold tiles
+		if(!i.value().hot && i.value().owners.size() == i.key()->ref.load()) {
+			const Owner &o = i.value().owners.first();
+			job->_tiles.append(_maps.value(o.storage).first()->_tiles.value(o.key));
+		}
+	}
+
+	if(job->_tiles.isEmpty()) {
+		delete job;
+		return 0;
+	}
+
+	return job;
+}
+
+int TileCompressor::apply(const TileCompressionJob *job)
+{
+	Q_ASSERT(job->_compressed.size() == job->_tiles.size());
+
+	// Pick the replacement tiles first: detaching the maps
+	// changes the reference counts.
+	QHash<const void*, QHash<quint64, Tile> > replacements;
+	int released = 0;
+	for(int i=0;i<job->_compressed.size();++i) {
+		const QByteArray &c = job->_compressed.at(i);
+		if(c.isNull())
+			continue;
+
+		const TileData *d = job->_tiles.at(i)._data.constData();
+		const Entry e = _entries.value(d);
+
+		// The job holds one reference. If there are others besides
+		// the cold tiles, the data would not be released.
+		if(e.hot || e.owners.isEmpty() || e.owners.size() + 1 != d->ref.load())
+			continue;
+
+		Tile compressed;
+		compressed._compressed = c;
+		compressed._compressedRevision = d->revision;
+
+		foreach(const Owner &o, e.owners)
+			replacements[o.storage].insert(o.key, compressed);
+		++released;
+	}
+
+	// Replace the tiles in one of the maps sharing the storage
+	// and let the others share the modified copy.
+	QHashIterator<const void*, QHash<quint64, Tile> > i(replacements);
+	while(i.hasNext()) {
+		i.next();
+		const QVector<TileMap*> maps = _maps.value(i.key());
+		Q_ASSERT(!maps.isEmpty());
+
+		TileMap *first = maps.first();
+		first->detach();
+
+		QHashIterator<quint64, Tile> r(i.value());
+		while(r.hasNext()) {
+			r.next();
+			first->_tiles[r.key()] = r.value();
+		}
+
+		for(int j=1;j<maps.size();++j)
+			maps.at(j)->_tiles = first->_tiles;
+	}
+
+	return released;
+}
+
+}
@@ -0,0 +1,143 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef PAINTCORE_TILECOMPRESSOR_H
+#define PAINTCORE_TILECOMPRESSOR_H
+
+#include <QHash>
+#include <QVector>
+#include <QByteArray>
+
+#include "tile.h"
+
+namespace paintcore {
+
+class Layer;
+class LayerStack;
+class Savepoint;
+class TileMap;
+
+/**
+ * @brief A batch of tiles to be compressed
+ *
+ * The job holds a reference to the tile data, so the data cannot
+ * change while it is being compressed.
+ */
+class TileCompressionJob {
+	friend class TileCompressor;
+public:
+	//! Compress the tiles. This can be called from a worker thread.
+	void run();
+
+	//! Get the number of tiles in this job
+	int size() const { return _tiles.size(); }
+
+private:
+	TileCompressionJob() { }
+
+	QVector<Tile> _tiles;
+	QVector<QByteArray> _compressed;
+};
+
+/**
+ * @brief Cold tile compressor
+ *
+ * Old savepoints and hidden layers are rarely accessed, so their tiles
+ * can be kept in compressed form. The compressor is used in three steps:
+ *
+ * 1. The canvas and the savepoints (newest first) are added to a compressor
+ *    and prepare() is called to pick the tiles to compress.
+ * 2. The returned job is run, typically in a background thread.
+ * 3. A new compressor is filled in the same way as in step 1 and the job
+ *    results are applied to the current tiles.
+ *
+ * Tiles of the visible layers are never compressed. Savepoints are kept
+ * uncompressed until the size of their (unshared) tile data exceeds the
+ * memory budget. Tile data is compressed only if nothing else references it,
+ * otherwise no memory would be saved.
+ *
+ * The compressed tiles are put in place through the layers' tile maps:
+ * the first map using a shared storage gets a modified copy of it and
+ * the other maps are made to share that copy, so tiles are never modified
+ * in place. Layers that become visible again decompress their tiles
+ * (see Layer::decompressTiles.)
+ *
+ * The compressor itself must only be used in the thread that owns the canvas.
+ */
+class TileCompressor {
+public:
+	TileCompressor();
+
+	//! Add the current canvas content
+	void addCanvas(LayerStack *stack);
+
+	//! Add a savepoint. Savepoints must be added from the newest to the oldest
+	void addSavepoint(Savepoint *savepoint);
+
+	//! Select the tiles to compress. Returns null if there is nothing to do
+	TileCompressionJob *prepare() const;
+
+	/**
+	 * @brief Replace the tiles with their compressed versions
+	 *
+	 * Tiles that have been modified or that have become active since
+	 * the job was prepared are skipped.
+	 *
+	 * @return number of tile data blocks released
+	 */
+	int apply(const TileCompressionJob *job);
+
+	//! Enable or disable cold tile compression
+	static void setEnabled(bool enable);
+
+	//! Is cold tile compression enabled?
+	static bool isEnabled();
+
+	//! Set the amount of savepoint tile data (in bytes) kept uncompressed
+	static void setBudget(qint64 bytes);
+
+	//! Get the savepoint memory budget
+	static qint64 budget();
+
+private:
+	//! A stored tile, identified by its storage and key
+	struct Owner {
+		const void *storage;
+		quint64 key;
+	};
+
+	struct Entry {
+		Entry() : hot(false) { }
+		QVector<Owner> owners;
+		bool hot;
+	};
+
+	void addLayer(Layer *layer, bool hot);
+	qint64 newHotBytes(const Layer *layer, QHash<const TileData*, bool> &seen) const;
+
+	QHash<const TileData*, Entry> _entries;
+	QHash<const void*, bool> _visited;
+	QHash<const void*, QVector<TileMap*> > _maps;
+	qint64 _hotBytes;
+	bool _budgetExceeded;
+};
+
+}
+
+#endif
@@ -0,0 +1,94 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "tilemap.h"
+
+namespace paintcore {
+
+TileMap::TileMap()
+	: _xtiles(0), _ytiles(0), _x0(0), _y0(0)
+{
+}
+
+TileMap::TileMap(int xtiles, int ytiles)
+	: _xtiles(xtiles), _ytiles(ytiles), _x0(0), _y0(0)
+{
+}
+
+Tile &TileMap::ref(int index)
+{
+	Q_ASSERT(index>=0 && index<_xtiles*_ytiles);
+	const quint64 k = key(index % _xtiles, index / _xtiles);
+	QHash<quint64, Tile>::iterator i = _tiles.find(k);
+	if(i == _tiles.end())
+		i = _tiles.insert(k, _fill);
+	return i.value();
+}
+
+void TileMap::set(int index, const Tile &tile)
+{
+	Q_ASSERT(index>=0 && index<_xtiles*_ytiles);
+	_tiles.insert(key(index % _xtiles, index / _xtiles), tile);
+}
+
+void TileMap::remove(int index)
+{
+	Q_ASSERT(index>=0 && index<_xtiles*_ytiles);
+	_tiles.remove(key(index % _xtiles, index / _xtiles));
+}
+
+void TileMap::fill(const Tile &tile)
+{
+	_tiles.clear();
+	_fill = tile;
+}
+
+QVector<int> TileMap::indexes() const
+{
+	QVector<int> idx;
+	idx.reserve(_tiles.size());
+	for(const_iterator i=_tiles.constBegin();i!=_tiles.constEnd();++i) {
+		const int x = qint32(i.key() >> 32) - _x0;
+		const int y = qint32(i.key() & 0xffffffff) - _y0;
+		idx.append(y * _xtiles + x);
+	}
+	return idx;
+}
+
+void TileMap::resize(int dx, int dy, int xtiles, int ytiles)
+{
+	_x0 += dx;
+	_y0 += dy;
+	_xtiles = xtiles;
+	_ytiles = ytiles;
+
+	// Drop the tiles that were cropped away
+	QHash<quint64, Tile>::iterator i = _tiles.begin();
+	while(i != _tiles.end()) {
+		const int x = qint32(i.key() >> 32) - _x0;
+		const int y = qint32(i.key() & 0xffffffff) - _y0;
+		if(x<0 || x>=_xtiles || y<0 || y>=_ytiles)
+			i = _tiles.erase(i);
+		else
+			++i;
+	}
+}
+
+}
@@ -0,0 +1,151 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef PAINTCORE_TILEMAP_H
+#define PAINTCORE_TILEMAP_H
+
+#include <QHash>
+#include <QVector>
+
+#include "tile.h"
+
+namespace paintcore {
+
+/**
+ * @brief Sparse tile storage
+ *
+ * Only tiles that differ from the fill tile are stored. The rest of
+ * the layer is implicitly filled with the fill tile, which is typically
+ * a null (transparent) or a solid color tile. Memory usage is thus
+ * proportional to the painted area rather than the size of the layer.
+ *
+ * Tiles are stored in a hash table keyed by their coordinates relative
+ * to a movable origin. Resizing the map moves the origin instead of the
+ * tiles, so the existing tiles never need to be copied.
+ *
+ * Like the other tile containers, the map is implicitly shared.
+ * Reading the map from multiple threads is safe, but modifying it is not.
+ */
+class TileMap {
+	friend class TileCompressor;
+public:
+	typedef QHash<quint64, Tile>::const_iterator const_iterator;
+
+	//! Construct an empty map
+	TileMap();
+
+	//! Construct a map filled with null tiles
+	TileMap(int xtiles, int ytiles);
+
+	//! Get the width of the map in tiles
+	int xtiles() const { return _xtiles; }
+
+	//! Get the height of the map in tiles
+	int ytiles() const { return _ytiles; }
+
+	//! Get a tile
+	const Tile &at(int x, int y) const {
+		Q_ASSERT(x>=0 && x<_xtiles && y>=0 && y<_ytiles);
+		const_iterator i = _tiles.constFind(key(x, y));
+		return i == _tiles.constEnd() ? _fill : i.value();
+	}
+
+	//! Get a tile
+	const Tile &at(int index) const {
+		Q_ASSERT(index>=0 && index<_xtiles*_ytiles);
+		return at(index % _xtiles, index / _xtiles);
+	}
+
+	/**
+	 * @brief Get a modifiable reference to a tile
+	 *
+	 * If the tile is not stored yet, a copy of the fill tile is
+	 * added to the map. The reference remains valid until the tile is
+	 * removed or the map is detached, resized or filled.
+	 */
+	Tile &ref(int index);
+
+	//! Replace a tile
+	void set(int index, const Tile &tile);
+
+	//! Remove a tile. Its value reverts to the fill tile.
+	void remove(int index);
+
+	//! Replace all tiles with the given tile
+	void fill(const Tile &tile);
+
+	//! Get the tile all non-stored tiles are equal to
+	const Tile &fillTile() const { return _fill; }
+
+	/**
+	 * @brief Change the fill tile
+	 *
+	 * Unlike fill(), this keeps the stored tiles. Only the value
+	 * of the tiles that are not stored changes.
+	 */
+	void setFillTile(const Tile &tile) { _fill = tile; }
+
+	//! Get the number of individually stored tiles
+	int stored() const { return _tiles.size(); }
+
+	//! Get the indexes of the individually stored tiles (in no particular order)
+	QVector<int> indexes() const;
+
+	/**
+	 * @brief Change the size of the map
+	 *
+	 * Tile (x, y) of the resized map is tile (x+dx, y+dy) of the old map.
+	 * Stored tiles that fall outside the new bounds are dropped.
+	 * New tiles have the value of the fill tile.
+	 */
+	void resize(int dx, int dy, int xtiles, int ytiles);
+
+	//! Make sure the tile storage is not shared with other maps
+	void detach() { _tiles.detach(); }
+
+	/**
+	 * @brief Get an identifier for the tile storage
+	 *
+	 * Maps sharing the same storage have the same identifier.
+	 * Returns null if there are no stored tiles.
+	 */
+	const void *storageId() const { return _tiles.isEmpty() ? 0 : &_tiles.constBegin().value(); }
+
+	//! Iterate through the stored tiles
+	const_iterator constBegin() const { return _tiles.constBegin(); }
+	const_iterator constEnd() const { return _tiles.constEnd(); }
+
+private:
+	quint64 key(int x, int y) const {
+		return (quint64(quint32(x + _x0)) << 32) | quint32(y + _y0);
+	}
+
+	QHash<quint64, Tile> _tiles;
+	Tile _fill;
+	int _xtiles;
+	int _ytiles;
+
+	// Position of the top-left tile relative to the storage origin
+	int _x0;
+	int _y0;
+};
+
+}
+
+#endif
@@ -0,0 +1,290 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <QMutex>
+#include <QDebug>
+
+#include <cstdlib>
+#include <new>
+
+#ifdef Q_OS_WIN
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "tilepool.h"
+#include "tile.h"
+
+namespace paintcore {
+
+namespace {
+
+// Slabs are aligned to their size, so the slab a tile belongs
+// to can be found by masking the tile pointer.
+static const size_t SLAB_SIZE = 2 * 1024 * 1024;
+static const size_t SLOT_ALIGN = 64;
+static const size_t SLOT_SIZE = (sizeof(TileData) + SLOT_ALIGN - 1) / SLOT_ALIGN * SLOT_ALIGN;
+
+struct FreeSlot {
+	FreeSlot *next;
+};
+
+// The slab header is stored at the start of the slab
+struct Slab {
+	Slab *prev, *next;     // list of slabs with free slots
+	FreeSlot *freelist;    // released slots
+	int used;              // number of allocated slots
+	int untouched;         // index of the first slot never handed out
+	bool huge;             // backed by huge pages?
+
+	uchar *slot(int i) { return reinterpret_cast<uchar*>(this) + HEADER_SIZE + i * SLOT_SIZE; }
+
+	static const size_t HEADER_SIZE;
+	static const int CAPACITY;
+};
+
+const size_t Slab::HEADER_SIZE = (sizeof(Slab) + SLOT_ALIGN - 1) / SLOT_ALIGN * SLOT_ALIGN;
+const int Slab::CAPACITY = int((SLAB_SIZE - Slab::HEADER_SIZE) / SLOT_SIZE);
+
+class Pool {
+public:
+	Pool()
+		: _partial(0), _spare(0), _live(0), _peak(0), _slabs(0), _hugeSlabs(0)
+	{
+		_useHugePages = !qgetenv("DRAWPILE_HUGEPAGES").isEmpty();
+	}
+
+	void *allocate()
+	{
+		QMutexLocker lock(&_mutex);
+
+		Slab *slab = _partial;
+		if(!slab) {
+			slab = newSlab();
+			if(!slab)
+				throw std::bad_alloc();
+			link(slab);
+		}
+
+		void *ptr;
+		if(slab->freelist) {
+			ptr = slab->freelist;
+			slab->freelist = slab->freelist->next;
+		} else {
+			// Hand out slots in order, so untouched memory is never paged in
+			ptr = slab->slot(slab->untouched++);
+		}
+
+		if(++slab->used == Slab::CAPACITY)
+			unlink(slab);
+
+		if(++_live > _peak)
+			_peak = _live;
+
+		return ptr;
+	}
+
+	void release(void *ptr)
+	{
+		Slab *slab = reinterpret_cast<Slab*>(quintptr(ptr) & ~quintptr(SLAB_SIZE-1));
+
+		QMutexLocker lock(&_mutex);
+
+		FreeSlot *fs = static_cast<FreeSlot*>(ptr);
+		fs->next = slab->freelist;
+		slab->freelist = fs;
+
+		if(slab->used-- == Slab::CAPACITY)
+			link(slab);
+
+		--_live;
+
+		if(slab->used == 0) {
+			// Return empty slabs to the system, but keep one around
+			// to avoid thrashing when a single tile is repeatedly
+			// allocated and released.
+			unlink(slab);
+			if(_spare)
+				freeSlab(_spare);
+			_spare = slab;
+		}
+	}
+
+	TilePool::Stats stats()
+	{
+		QMutexLocker lock(&_mutex);
+		TilePool::Stats s;
+		s.live = _live;
+		s.free = _slabs * Slab::CAPACITY - _live;
+		s.peak = _peak;
+		s.slabs = _slabs;
+		s.hugeSlabs = _hugeSlabs;
+		return s;
+	}
+
+private:
+	Slab *newSlab()
+	{
+		if(_spare) {
+			Slab *slab = _spare;
+			_spare = 0;
+			return slab;
+		}
+
+		void *mem = 0;
+		bool huge = false;
+
+#if defined(Q_OS_WIN)
+		mem = _aligned_malloc(SLAB_SIZE, SLAB_SIZE);
+#else
+#if defined(MAP_HUGETLB)
+		if(_useHugePages) {
+			// Explicitly reserved huge pages. The mapping is naturally aligned.
+			mem = mmap(0, SLAB_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+			if(mem == MAP_FAILED)
+				mem = 0;
+			else
+				huge = true;
+		}
+#endif
+		if(!mem) {
+			// Slabs are mapped directly rather than taken from the heap,
+			// so that releasing a slab always returns it to the system.
+			mem = mapAligned();
+#if defined(MADV_HUGEPAGE)
+			// Transparent huge pages
+			if(mem && _useHugePages)
+				madvise(mem, SLAB_SIZE, MADV_HUGEPAGE);
+#endif
+		}
+#endif
+
+		if(!mem) {
+			qWarning() << "Couldn't allocate tile memory slab!";
+			return 0;
+		}
+
+		Slab *slab = static_cast<Slab*>(mem);
+		slab->prev = slab->next = 0;
+		slab->freelist = 0;
+		slab->used = 0;
+		slab->untouched = 0;
+		slab->huge = huge;
+
+		++_slabs;
+		if(huge)
+			++_hugeSlabs;
+
+		return slab;
+	}
+
+	void freeSlab(Slab *slab)
+	{
+		--_slabs;
+#if defined(Q_OS_WIN)
+		_aligned_free(slab);
+#else
+		if(slab->huge)
+			--_hugeSlabs;
+		munmap(slab, SLAB_SIZE);
+#endif
+	}
+
+#if !defined(Q_OS_WIN)
+	/**
+	 * Map an anonymous block of SLAB_SIZE bytes aligned to its size.
+	 * Twice the size is mapped and the excess around the aligned
+	 * block is unmapped again.
+	 */
+	static void *mapAligned()
+	{
+		void *mem = mmap(0, SLAB_SIZE * 2, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if(mem == MAP_FAILED)
+			return 0;
+
+		const quintptr start = quintptr(mem);
+		const quintptr aligned = (start + SLAB_SIZE - 1) & ~quintptr(SLAB_SIZE-1);
+		const quintptr end = start + SLAB_SIZE * 2;
+
+		if(aligned > start)
+			munmap(mem, aligned - start);
+		if(end > aligned + SLAB_SIZE)
+			munmap(reinterpret_cast<void*>(aligned + SLAB_SIZE), end - aligned - SLAB_SIZE);
+
+		return reinterpret_cast<void*>(aligned);
+	}
+#endif
+
+	void link(Slab *slab)
+	{
+		slab->prev = 0;
+		slab->next = _partial;
+		if(_partial)
+			_partial->prev = slab;
+		_partial = slab;
+	}
+
+	void unlink(Slab *slab)
+	{
+		if(slab->prev)
+			slab->prev->next = slab->next;
+		else
+			_partial = slab->next;
+		if(slab->next)
+			slab->next->prev = slab->prev;
+		slab->prev = slab->next = 0;
+	}
+
+	QMutex _mutex;
+	Slab *_partial;
+	Slab *_spare;
+	int _live, _peak;
+	int _slabs, _hugeSlabs;
+	bool _useHugePages;
+};
+
+Pool &pool()
+{
+	// Intentionally never deleted: tiles may still be released
+	// by static destructors at program exit.
+	static Pool *p = new Pool;
+	return *p;
+}
+
+}
+
+void *TilePool::allocate()
+{
+	return pool().allocate();
+}
+
+void TilePool::release(void *ptr)
+{
+	if(ptr)
+		pool().release(ptr);
+}
+
+TilePool::Stats TilePool::stats()
+{
+	return pool().stats();
+}
+
+}
@@ -0,0 +1,71 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef PAINTCORE_TILEPOOL_H
+#define PAINTCORE_TILEPOOL_H
+
+#include <QtGlobal>
+
+namespace paintcore {
+
+/**
+ * @brief Memory pool for tile data
+ *
+ * Tile data is allocated from large (2 MB) aligned slabs, each holding
+ * over a hundred tiles. This avoids fragmenting the heap with
+ * constant 16 KB allocations and lets memory be returned to the
+ * operating system when a slab becomes empty.
+ *
+ * If the environment variable DRAWPILE_HUGEPAGES is set, the pool
+ * tries to back the slabs with huge pages (Linux only).
+ *
+ * All functions are thread safe.
+ */
+class TilePool {
+public:
+	struct Stats {
+		//! Number of tiles currently allocated
+		int live;
+
+		//! Number of free tile slots in allocated slabs
+		int free;
+
+		//! Highest number of simultaneously allocated tiles
+		int peak;
+
+		//! Number of allocated slabs
+		int slabs;
+
+		//! Number of slabs backed by huge pages
+		int hugeSlabs;
+	};
+
+	//! Allocate memory for one TileData
+	static void *allocate();
+
+	//! Return memory allocated with allocate()
+	static void release(void *ptr);
+
+	//! Get the current pool statistics
+	static Stats stats();
+};
+
+}
+
+#endif
@@ -0,0 +1,138 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "tilepyramid.h"
+#include "displaycache.h"
+#include "tile.h"
+
+namespace paintcore {
+
+namespace {
+
+// Cost of a cached tile in kilobytes
+const int TILE_COST = Tile::BYTES / 1024;
+
+}
+
+TilePyramid::TilePyramid()
+	: _cache(DisplayCache::memoryLimit() * 1024)
+{
+}
+
+void TilePyramid::resize(int xtiles, int ytiles)
+{
+	_cache.clear();
+	_dirty.clear();
+
+	while((xtiles>1 || ytiles>1) && _dirty.size() < MAX_LEVEL) {
+		xtiles = (xtiles+1) / 2;
+		ytiles = (ytiles+1) / 2;
+		_dirty.append(TileBitmap(xtiles, ytiles));
+		_dirty.last().setAll();
+	}
+}
+
+const QImage *TilePyramid::object(int level, int x, int y)
+{
+	Q_ASSERT(level>0 && level<=levels());
+	return _cache.object(key(level, x, y));
+}
+
+void TilePyramid::insert(int level, int x, int y, const QImage &image)
+{
+	Q_ASSERT(level>0 && level<=levels());
+
+	// Pick up changes to the memory limit
+	const int limit = DisplayCache::memoryLimit() * 1024;
+	if(_cache.maxCost() != limit)
+		_cache.setMaxCost(limit);
+
+	_cache.insert(key(level, x, y), new QImage(image), TILE_COST);
+}
+
+bool TilePyramid::isDirty(int level, int x, int y) const
+{
+	Q_ASSERT(level>0 && level<=levels());
+	const TileBitmap &dirty = _dirty.at(level-1);
+	return dirty.test(y*dirty.xtiles() + x);
+}
+
+void TilePyramid::setClean(int level, int x, int y)
+{
+	Q_ASSERT(level>0 && level<=levels());
+	TileBitmap &dirty = _dirty[level-1];
+	dirty.clear(y*dirty.xtiles() + x);
+}
+
+void TilePyramid::markDirty(const QRect &tiles)
+{
+	if(tiles.isEmpty())
+		return;
+
+	for(int l=0;l<_dirty.size();++l) {
+		const int shift = l + 1;
+		_dirty[l].set(QRect(
+			QPoint(tiles.left() >> shift, tiles.top() >> shift),
+			QPoint(tiles.right() >> shift, tiles.bottom() >> shift)
+		));
+	}
+}
+
+void TilePyramid::markDirty()
+{
+	for(int l=0;l<_dirty.size();++l)
+		_dirty[l].setAll();
+}
+
+void TilePyramid::downscale(const quint32 *src, QImage &dest, int quadrant)
+{
+	Q_ASSERT(dest.width() == Tile::SIZE && dest.height() == Tile::SIZE);
+	Q_ASSERT(quadrant>=0 && quadrant<4);
+
+	const int HALF = Tile::SIZE / 2;
+	const int x0 = (quadrant % 2) * HALF;
+	const int y0 = (quadrant / 2) * HALF;
+
+	for(int y=0;y<HALF;++y) {
+		const quint32 *row0 = src + y*2*Tile::SIZE;
+		const quint32 *row1 = row0 + Tile::SIZE;
+		quint32 *out = reinterpret_cast<quint32*>(dest.scanLine(y0+y)) + x0;
+
+		for(int x=0;x<HALF;++x,row0+=2,row1+=2) {
+			// Average two channels at a time. The sum of four 8 bit values
+			// fits in the 16 bits available for each channel.
+			const quint32 rb = (row0[0] & 0x00ff00ff) + (row0[1] & 0x00ff00ff)
+				+ (row1[0] & 0x00ff00ff) + (row1[1] & 0x00ff00ff) + 0x00020002;
+			const quint32 ag = ((row0[0] >> 8) & 0x00ff00ff) + ((row0[1] >> 8) & 0x00ff00ff)
+				+ ((row1[0] >> 8) & 0x00ff00ff) + ((row1[1] >> 8) & 0x00ff00ff) + 0x00020002;
+
+			*(out++) = ((rb >> 2) & 0x00ff00ff) | (((ag >> 2) & 0x00ff00ff) << 8);
+		}
+	}
+}
+
+QImage TilePyramid::emptyTile()
+{
+	QImage img(Tile::SIZE, Tile::SIZE, QImage::Format_ARGB32_Premultiplied);
+	img.fill(0);
+	return img;
+}
+
+}
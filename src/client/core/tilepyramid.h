@@ -0,0 +1,123 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef PAINTCORE_TILEPYRAMID_H
+#define PAINTCORE_TILEPYRAMID_H
+
+#include <QCache>
+#include <QImage>
+#include <QVector>
+
+#include "tilebitmap.h"
+
+namespace paintcore {
+
+/**
+ * @brief Downscaled versions of the flattened canvas for zoomed out views
+ *
+ * Level 1 is half the size of the canvas, level 2 a quarter and so on.
+ * Each level is made of 64x64 pixel tiles, so a tile at level n covers
+ * 2^n by 2^n tiles of the canvas. A tile is built by averaging the four
+ * tiles of the level below it, or the flattened canvas tiles at level 1.
+ *
+ * Like the display cache, the tiles are cached on demand and the least
+ * recently used ones are dropped when the memory limit is reached.
+ * Changes to the canvas mark the tiles above them dirty on every level,
+ * so only the changed branches need to be rebuilt. Since tiles may be
+ * rebuilt in the background, the dirty flag is cleared separately
+ * when a tile is sent for rebuilding.
+ *
+ * The tiles are stored in premultiplied ARGB format.
+ *
+ * This class is not thread safe.
+ */
+class TilePyramid {
+public:
+	//! Highest level of the pyramid
+	static const int MAX_LEVEL = 8;
+
+	TilePyramid();
+
+	/**
+	 * @brief Set the size of the canvas in tiles
+	 *
+	 * All cached tiles are dropped.
+	 */
+	void resize(int xtiles, int ytiles);
+
+	//! Get the number of levels (excluding the full size canvas)
+	int levels() const { return _dirty.size(); }
+
+	//! Get the width of a level in tiles
+	int xtiles(int level) const { return _dirty.at(level-1).xtiles(); }
+
+	//! Get the height of a level in tiles
+	int ytiles(int level) const { return _dirty.at(level-1).ytiles(); }
+
+	/**
+	 * @brief Get a cached tile
+	 *
+	 * The tile may be out of date. See isDirty()
+	 * @return null if the tile is not in the cache
+	 */
+	const QImage *object(int level, int x, int y);
+
+	//! Put a tile into the cache
+	void insert(int level, int x, int y, const QImage &image);
+
+	//! Has the canvas under the tile changed since it was last rendered?
+	bool isDirty(int level, int x, int y) const;
+
+	//! Mark the tile as up to date
+	void setClean(int level, int x, int y);
+
+	//! Mark the tiles above the given area (in canvas tile coordinates) dirty
+	void markDirty(const QRect &tiles);
+
+	//! Mark all tiles dirty
+	void markDirty();
+
+	/**
+	 * @brief Downscale a tile into a quarter of a tile of the next level
+	 *
+	 * Each destination pixel is the average of a 2x2 block of source pixels.
+	 *
+	 * @param src 64x64 pixel source tile (premultiplied alpha)
+	 * @param dest destination tile
+	 * @param quadrant which quarter of the destination tile to write (0-3, in row major order)
+	 */
+	static void downscale(const quint32 *src, QImage &dest, int quadrant);
+
+	//! Get a new empty (fully transparent) tile
+	static QImage emptyTile();
+
+private:
+	static quint64 key(int level, int x, int y) {
+		return (quint64(level) << 48) | (quint64(quint32(y)) << 24) | quint32(x);
+	}
+
+	QCache<quint64, QImage> _cache;
+
+	// Out of date tiles of each level, starting from level 1
+	QVector<TileBitmap> _dirty;
+};
+
+}
+
+#endif
@@ -0,0 +1,225 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <QColor>
+#include <cstring>
+
+#include "tilesnapshot.h"
+#include "layer.h"
+#include "rasterop.h"
+
+namespace paintcore {
+
+static const QRect FULL_TILE(0, 0, Tile::SIZE, Tile::SIZE);
+
+TileSnapshot::TileSnapshot(const QList<Layer*> &layers, int xindex, int yindex)
+	: _xindex(xindex), _yindex(yindex)
+{
+	_layers.reserve(layers.count());
+	foreach(const Layer *l, layers) {
+		LayerTile lt;
+		lt.visible = l->visible();
+		lt.opacity = l->opacity();
+		lt.blend = l->blendmode();
+		lt.hasSublayers = !l->sublayers().isEmpty();
+
+		// The tiles of hidden layers are not needed
+		if(lt.visible) {
+			lt.tile = l->tile(xindex, yindex);
+			foreach(const Layer *sl, l->sublayers()) {
+				if(sl->visible()) {
+					SubLayer s;
+					s.tile = sl->tile(xindex, yindex);
+					s.opacity = sl->opacity();
+					s.blend = sl->blendmode();
+					lt.sublayers.append(s);
+				}
+			}
+		}
+
+		lt.key = FlattenCache::LayerKey(l, lt.tile, !lt.sublayers.isEmpty());
+		_layers.append(lt);
+	}
+}
+
+void TileSnapshot::flatten(quint32 *data) const
+{
+	Q_ASSERT(!isNull());
+	const int bottom = beginFlattening(data, topmostOpaqueLayer());
+	compositeLayers(data, bottom, _layers.count(), FULL_TILE);
+}
+
+/**
+ * Find the topmost layer that hides everything below it.
+ * An opaque pixel composited in normal mode at full opacity
+ * replaces the destination pixel exactly, so the layers
+ * below need not be composited at all.
+ *
+ * @return layer index or -1 if there is no such layer
+ */
+int TileSnapshot::topmostOpaqueLayer() const
+{
+	int i = _layers.count() - 1;
+	while(i>=0) {
+		const LayerTile &l = _layers.at(i);
+		if(l.visible && l.opacity == 255 && l.blend == 1 &&
+				l.sublayers.isEmpty() && l.tile.isOpaque())
+			break;
+		--i;
+	}
+	return i;
+}
+
+/**
+ * Initialize the tile buffer with the topmost opaque layer, or
+ * the background pattern if there is no opaque layer.
+ *
+ * @return the index of the next layer to composite
+ */
+int TileSnapshot::beginFlattening(quint32 *data, int opaqueLayer) const
+{
+	if(opaqueLayer>=0) {
+		_layers.at(opaqueLayer).tile.copyTo(data);
+		return opaqueLayer + 1;
+	}
+
+	// Start out with a checkerboard pattern to denote transparency
+	Tile::fillChecker(data, QColor(128,128,128), Qt::white);
+	return 0;
+}
+
+/**
+ * Flatten the tile using the cache.
+ *
+ * The composite of the layers below the lowest changed layer is stored
+ * in the cache. While a layer is being drawn on, redrawing the tile
+ * needs to composite only that layer and the layers above it.
+ *
+ * Only the bottom part of the stack can be cached: blending operations are
+ * not associative, so the layers above could not be pre-composited without
+ * changing the result.
+ *
+ * When the cached layers can be used as is, only the requested part of
+ * the tile is composited. Otherwise the whole tile is flattened, since the
+ * cache must be refreshed.
+ */
+QRect TileSnapshot::flatten(quint32 *data, const QRect &rect, FlattenCache *cache, int cacheIndex) const
+{
+	Q_ASSERT(!isNull());
+	const int layers = _layers.count();
+
+	// Current state of the layers at this tile
+	QVector<FlattenCache::LayerKey> keys(layers);
+	int sublayers = layers;
+	for(int i=0;i<layers;++i) {
+		keys[i] = _layers.at(i).key;
+
+		// Layers with sublayers are being drawn on right now
+		if(!_layers.at(i).sublayers.isEmpty() && sublayers==layers)
+			sublayers = i;
+	}
+
+	FlattenCache::Entry *entry = cache->take(cacheIndex);
+
+	// Find the lowest layer that has changed since the last time
+	int changed = 0;
+	const int known = qMin(layers, entry->keys.size());
+	while(changed < known && keys.at(changed) == entry->keys.at(changed))
+		++changed;
+
+	const int opaqueLayer = topmostOpaqueLayer();
+	const bool useCached = entry->count > 0 && entry->count <= changed && entry->count > opaqueLayer;
+
+	// Cache the composite of the layers below the changed one
+	const int cached = qMax(useCached ? entry->count : opaqueLayer + 1, qMin(changed, sublayers));
+
+	if(useCached && cached == entry->count) {
+		// Only the changed area needs to be composited
+		memcpy(data + rect.y() * Tile::SIZE,
+			entry->pixels.constData() + rect.y() * Tile::SIZE,
+			rect.height() * Tile::SIZE * sizeof(quint32));
+
+		entry->keys = keys;
+		compositeLayers(data, cached, layers, rect);
+
+		cache->insert(cacheIndex, entry);
+		return rect;
+	}
+
+	int bottom;
+	if(useCached) {
+		memcpy(data, entry->pixels.constData(), Tile::BYTES);
+		bottom = entry->count;
+	} else {
+		bottom = beginFlattening(data, opaqueLayer);
+	}
+
+	compositeLayers(data, bottom, cached, FULL_TILE);
+
+	if(cached==0) {
+		entry->pixels.clear();
+	} else if(!useCached || cached != entry->count) {
+		entry->pixels.resize(Tile::LENGTH);
+		memcpy(entry->pixels.data(), data, Tile::BYTES);
+	}
+	entry->count = cached;
+	entry->keys = keys;
+
+	compositeLayers(data, cached, layers, FULL_TILE);
+
+	cache->insert(cacheIndex, entry);
+	return FULL_TILE;
+}
+
+/**
+ * Composite a range of layers onto the tile buffer
+ *
+ * @param from index of the first layer to composite
+ * @param to index of the layer after the last one to composite
+ * @param rect the part of the tile to composite
+ */
+void TileSnapshot::compositeLayers(quint32 *data, int from, int to, const QRect &rect) const
+{
+	for(int i=from;i<to;++i) {
+		const LayerTile &l = _layers.at(i);
+		if(l.visible) {
+			if(l.hasSublayers) {
+				// Sublayers present, composite them first
+				quint32 ldata[Tile::SIZE*Tile::SIZE];
+				l.tile.copyTo(ldata);
+
+				foreach(const SubLayer &sl, l.sublayers)
+					sl.tile.mergeTo(ldata, sl.opacity, sl.blend, rect);
+
+				// Composite merged tile
+				for(int y=rect.top();y<=rect.bottom();++y) {
+					const int offset = y * Tile::SIZE + rect.x();
+					compositePixels(l.blend, data + offset, ldata + offset,
+							rect.width(), l.opacity);
+				}
+			} else if(!l.tile.isBlank()) {
+				// No sublayers, just this tile
+				l.tile.mergeTo(data, l.opacity, l.blend, rect);
+			}
+		}
+	}
+}
+
+}
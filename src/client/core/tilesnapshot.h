@@ -0,0 +1,102 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2014 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef PAINTCORE_TILESNAPSHOT_H
+#define PAINTCORE_TILESNAPSHOT_H
+
+#include <QList>
+#include <QVector>
+#include <QRect>
+
+#include "tile.h"
+#include "flattencache.h"
+
+namespace paintcore {
+
+class Layer;
+
+/**
+ * @brief The state of all layers at a single tile
+ *
+ * The snapshot holds its own references to the tiles and copies of the
+ * layer properties, so it can be flattened in another thread while the
+ * layers themselves keep changing. Taking a snapshot is cheap, since
+ * tiles are implicitly shared.
+ *
+ * Only visible layers contribute their tiles to the snapshot.
+ */
+class TileSnapshot {
+public:
+	//! Construct a null snapshot
+	TileSnapshot() : _xindex(-1), _yindex(-1) { }
+
+	//! Take a snapshot of a tile of the given layer stack
+	TileSnapshot(const QList<Layer*> &layers, int xindex, int yindex);
+
+	//! Is this a null snapshot?
+	bool isNull() const { return _xindex < 0; }
+
+	//! Get the X index of the tile
+	int xindex() const { return _xindex; }
+
+	//! Get the Y index of the tile
+	int yindex() const { return _yindex; }
+
+	//! Composite the visible layers into the given buffer
+	void flatten(quint32 *data) const;
+
+	/**
+	 * @brief Composite the visible layers using the flattening cache
+	 *
+	 * @param data the buffer to composite into
+	 * @param rect the part of the tile that needs to be updated
+	 * @param cache the cache of partially flattened tiles
+	 * @param cacheIndex the index of this tile in the cache
+	 * @return the part of the tile that was flattened
+	 */
+	QRect flatten(quint32 *data, const QRect &rect, FlattenCache *cache, int cacheIndex) const;
+
+private:
+	struct SubLayer {
+		Tile tile;
+		int opacity;
+		int blend;
+	};
+
+	struct LayerTile {
+		Tile tile;
+		bool visible;
+		int opacity;
+		int blend;
+		bool hasSublayers;         // does the layer have any sublayers (even hidden ones)?
+		QVector<SubLayer> sublayers; // the visible sublayers
+		FlattenCache::LayerKey key;
+	};
+
+	int topmostOpaqueLayer() const;
+	int beginFlattening(quint32 *data, int opaqueLayer) const;
+	void compositeLayers(quint32 *data, int from, int to, const QRect &rect) const;
+
+	QVector<LayerTile> _layers;
+	int _xindex, _yindex;
+};
+
+}
+
+#endif
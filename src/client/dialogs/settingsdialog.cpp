@@ -126,6 +126,14 @@ SettingsDialog::SettingsDialog(const QList<QAction*>& actions, QWidget *parent)
 	_ui->strokepreview->setCurrentIndex(cfg.value("previewstyle", 2).toInt());
 	cfg.endGroup();
 
+	cfg.beginGroup("settings/paintengine");
+	_ui->sharetiles->setChecked(cfg.value("sharetiles", true).toBool());
+	_ui->compresshistory->setChecked(cfg.value("compresshistory", true).toBool());
+	_ui->historybudget->setValue(cfg.value("historybudget", 64).toInt());
+	_ui->paralleldabs->setValue(cfg.value("paralleldabs", 32).toInt());
+	_ui->displaycache->setValue(cfg.value("displaycache", 256).toInt());
+	cfg.endGroup();
+
 	// Generate an editable list of shortcuts
 	_ui->shortcuts->verticalHeader()->setVisible(false);
 	_ui->shortcuts->setRowCount(_customactions.size());
@@ -195,6 +203,15 @@ void SettingsDialog::rememberSettings() const
 
 	cfg.endGroup();
 
+	// Remember paint engine settings
+	cfg.beginGroup("settings/paintengine");
+	cfg.setValue("sharetiles", _ui->sharetiles->isChecked());
+	cfg.setValue("compresshistory", _ui->compresshistory->isChecked());
+	cfg.setValue("historybudget", _ui->historybudget->value());
+	cfg.setValue("paralleldabs", _ui->paralleldabs->value());
+	cfg.setValue("displaycache", _ui->displaycache->value());
+	cfg.endGroup();
+
 	// Remember shortcuts. Only shortcuts that have been changed
 	// from their default values are stored.
 	cfg.beginGroup("settings/shortcuts");
@@ -41,6 +41,11 @@
 #include "mainwindow.h"
 #include "loader.h"
 
+#include "core/tile.h"
+#include "core/layer.h"
+#include "core/displaycache.h"
+#include "core/tilecompressor.h"
+
 #include "scene/canvasview.h"
 #include "scene/canvasscene.h"
 #include "scene/selectionitem.h"
@@ -210,8 +215,10 @@ MainWindow::MainWindow(bool restoreWindowPosition)
 
 	connect(qApp, SIGNAL(settingsChanged()), this, SLOT(updateStrokePreviewMode()));
 	connect(qApp, SIGNAL(settingsChanged()), this, SLOT(updateShortcuts()));
+	connect(qApp, SIGNAL(settingsChanged()), this, SLOT(updatePaintEngineSettings()));
 
 	updateStrokePreviewMode();
+	updatePaintEngineSettings();
 
 	// Create actions and menus
 	setupActions();
@@ -1119,6 +1126,20 @@ void MainWindow::updateStrokePreviewMode()
 	_canvas->setStrokePreview(preview);
 }
 
+/**
+ * Apply paint engine performance settings. These are global, shared by all windows.
+ */
+void MainWindow::updatePaintEngineSettings()
+{
+	QSettings cfg;
+	cfg.beginGroup("settings/paintengine");
+	paintcore::Tile::setInterning(cfg.value("sharetiles", true).toBool());
+	paintcore::TileCompressor::setEnabled(cfg.value("compresshistory", true).toBool());
+	paintcore::TileCompressor::setBudget(cfg.value("historybudget", 64).toInt() * qint64(1024 * 1024));
+	paintcore::Layer::setParallelDabThreshold(cfg.value("paralleldabs", 32).toInt());
+	paintcore::DisplayCache::setMemoryLimit(cfg.value("displaycache", 256).toInt());
+}
+
 void MainWindow::sessionConfChanged(bool locked, bool layerctrllocked, bool closed)
 {
 	getAction("locksession")->setChecked(locked);
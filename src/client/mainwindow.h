@@ -119,6 +119,7 @@ class MainWindow : public QMainWindow {
 
 		void updateShortcuts();
 		void updateStrokePreviewMode();
+		void updatePaintEngineSettings();
 
 		void copyVisible();
 		void copyLayer();
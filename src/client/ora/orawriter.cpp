@@ -20,6 +20,8 @@
 #include <QDomDocument>
 #include <QBuffer>
 #include <QDebug>
+#include <QPainter>
+#include <cstring>
 
 #include "ora/zipwriter.h"
 #include "ora/orawriter.h"
@@ -109,11 +111,58 @@ bool writeLayer(ZipWriter &zf, const paintcore::LayerStack *layers, int index)
 	return true;
 }
 
+/**
+ * Make a downscaled flattened image of the layer stack.
+ *
+ * The image is flattened and scaled a few scanlines at a time, so
+ * the full size image is never needed in memory.
+ */
+QImage flatThumbnail(const paintcore::LayerStack *layers, const QSize &maxsize)
+{
+	if(layers->width() <= maxsize.width() && layers->height() <= maxsize.height())
+		return layers->toFlatImage(false);
+
+	const QSize size = layers->size().scaled(maxsize, Qt::KeepAspectRatio).expandedTo(QSize(1, 1));
+	QImage thumb(size, QImage::Format_ARGB32);
+	thumb.fill(0);
+
+	QPainter painter(&thumb);
+	painter.setCompositionMode(QPainter::CompositionMode_Source);
+
+	// Bands are collected into a strip until the strip is tall
+	// enough to cover at least one row of the thumbnail
+	QImage strip;
+	int stripbottom = 0;
+	int thumby = 0;
+	for(int row=0;row<layers->flatBands();++row) {
+		const QImage band = layers->toFlatBand(row);
+		if(strip.isNull()) {
+			strip = band;
+		} else {
+			QImage taller(strip.width(), strip.height() + band.height(), QImage::Format_ARGB32);
+			for(int y=0;y<strip.height();++y)
+				memcpy(taller.scanLine(y), strip.constScanLine(y), strip.bytesPerLine());
+			for(int y=0;y<band.height();++y)
+				memcpy(taller.scanLine(strip.height() + y), band.constScanLine(y), band.bytesPerLine());
+			strip = taller;
+		}
+		stripbottom += band.height();
+
+		const int thumbbottom = qint64(stripbottom) * size.height() / layers->height();
+		if(thumbbottom > thumby) {
+			painter.drawImage(0, thumby,
+				strip.scaled(size.width(), thumbbottom - thumby, Qt::IgnoreAspectRatio, Qt::SmoothTransformation));
+			thumby = thumbbottom;
+			strip = QImage();
+		}
+	}
+
+	return thumb;
+}
+
 bool writeThumbnail(ZipWriter &zf, const paintcore::LayerStack *layers)
 {
-	QImage img = layers->toFlatImage(false);
-	if(img.width() > 256 || img.height() > 256)
-		img = img.scaled(QSize(256, 256), Qt::KeepAspectRatio, Qt::SmoothTransformation);
+	const QImage img = flatThumbnail(layers, QSize(256, 256));
 
 	QBuffer thumb;
 	thumb.open(QIODevice::ReadWrite);
@@ -36,6 +36,7 @@ CanvasItem::CanvasItem(QGraphicsItem *parent)
 {
 	_image = new paintcore::LayerStack(this);
 	connect(_image, SIGNAL(areaChanged(QRect)), this, SLOT(refreshImage(QRect)));
+	connect(_image, SIGNAL(rendered(QRect)), this, SLOT(refreshImage(QRect)));
 	connect(_image, SIGNAL(resized(int, int)), this, SLOT(canvasResize()));
 }
 
@@ -54,7 +55,7 @@ void CanvasItem::paint(QPainter *painter, const QStyleOptionGraphicsItem *option
 {
 	QRectF exposed = option->exposedRect.adjusted(-1, -1, 1, 1);
 	exposed &= QRectF(0,0,_image->width(),_image->height());
-	_image->paint(exposed, painter);
+	_image->paint(exposed, painter, option->levelOfDetailFromTransform(painter->worldTransform()));
 }
 
 void CanvasItem::canvasResize()
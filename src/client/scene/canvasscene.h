@@ -127,9 +127,10 @@ public:
 	 * @param x X coordinate
 	 * @param y Y coordinate
 	 * @param layer layer ID. If 0, the merged pixel value is picked.
+	 * @param dia diameter of the area whose average color is picked
 	 * @param bg pick background color
 	 */
-	void pickColor(int x, int y, int layer, bool bg);
+	void pickColor(int x, int y, int layer, int dia, bool bg);
 
 	/**
 	 * @brief Get the state tracker for this session.
@@ -306,7 +306,7 @@ void CanvasView::onPenDown(const paintcore::Point &p, bool right)
 
 		if(_specialpenmode) {
 			// quick color pick mode
-			_scene->pickColor(p.x(), p.y(), 0, right);
+			_scene->pickColor(p.x(), p.y(), 0, 1, right);
 		} else {
 			if(_smoothing>0 && _current_tool->allowSmoothing())
 				_smoother.addPoint(p);
@@ -321,7 +321,7 @@ void CanvasView::onPenMove(const paintcore::Point &p, bool right, bool shift, bo
 	if(_scene->hasImage() && !_locked) {
 		if(_specialpenmode) {
 			// quick color pick mode
-			_scene->pickColor(p.x(), p.y(), 0, right);
+			_scene->pickColor(p.x(), p.y(), 0, 1, right);
 		} else {
 			if(_smoothing>0 && _current_tool->allowSmoothing()) {
 				_smoother.addPoint(p);
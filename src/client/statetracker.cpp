@@ -20,12 +20,16 @@
 */
 #include <QDebug>
 #include <QDateTime>
+#include <QtConcurrent>
 
 #include "statetracker.h"
 #include "loader.h"
 
 #include "core/layerstack.h"
 #include "core/layer.h"
+#include "core/tile.h"
+#include "core/tilepool.h"
+#include "core/tilecompressor.h"
 
 #include "net/layerlist.h"
 #include "net/utils.h"
@@ -127,12 +131,16 @@ StateTracker::StateTracker(paintcore::LayerStack *image, net::LayerListModel *la
 		_myid(myId),
 		_msgstream_sizelimit(1024 * 1024 * 10),
 		_hassnapshot(true),
-		_showallmarkers(false)
+		_showallmarkers(false),
+		_compressjob(0)
 {
+	connect(&_compressor, SIGNAL(finished()), this, SLOT(applyTileCompression()));
 }
 
 StateTracker::~StateTracker()
 {
+	_compressor.waitForFinished();
+	delete _compressjob;
 }
 
 void StateTracker::receiveCommand(protocol::MessagePtr msg)
@@ -177,6 +185,13 @@ void StateTracker::receiveCommand(protocol::MessagePtr msg)
 					_savepoints.takeFirst();
 			}
 		}
+
+		const paintcore::TilePool::Stats pool = paintcore::TilePool::stats();
+		qDebug() << "Tile pool:" << pool.live << "live," << pool.free << "free," << pool.peak << "peak tiles in" << pool.slabs << "slabs";
+
+		const paintcore::Tile::InternStats intern = paintcore::Tile::internStats();
+		qDebug() << "Tile sharing:" << intern.entries << "unique tiles," << intern.shared << "shared references saving"
+			<< intern.shared * paintcore::Tile::BYTES / float(1024*1024) << "Mb," << intern.hits << "interned in total";
 	}
 
 	// Add command to history and execute it
@@ -371,17 +386,24 @@ void StateTracker::handlePenMove(const protocol::PenMove &cmd)
 		return;
 	}
 	
-	foreach(const protocol::PenPoint &pp, cmd.points()) {
-		paintcore::Point p(pp.x / 4.0, pp.y / 4.0, pp.p/qreal(0xffff));
-
-		if(ctx.pendown) {
-			layer->drawLine(cmd.contextId(), ctx.tool.brush, ctx.lastpoint, p, ctx.distance_accumulator);
-		} else {
+	// The whole message is drawn in one batch. If the stroke was
+	// already in progress, the line continues from the last point.
+	paintcore::PointVector points;
+	points.reserve(cmd.points().size() + 1);
+	if(ctx.pendown)
+		points.append(ctx.lastpoint);
+
+	foreach(const protocol::PenPoint &pp, cmd.points())
+		points.append(paintcore::Point(pp.x / 4.0, pp.y / 4.0, pp.p/qreal(0xffff)));
+
+	if(!cmd.points().isEmpty()) {
+		const bool newStroke = !ctx.pendown;
+		if(newStroke) {
 			ctx.pendown = true;
 			ctx.distance_accumulator = 0;
-			layer->dab(cmd.contextId(), ctx.tool.brush, p);
 		}
-		ctx.lastpoint = p;
+		layer->drawStroke(cmd.contextId(), ctx.tool.brush, points, newStroke, ctx.distance_accumulator);
+		ctx.lastpoint = points.last();
 	}
 
 	if(cmd.contextId() == _myid)
@@ -558,6 +580,9 @@ void StateTracker::handleUndo(protocol::Undo &cmd)
 		}
 		++pos;
 	}
+
+	// The whole replayed batch can be shown right away
+	_image->flushAreaChanged();
 }
 
 StateSavepoint StateTracker::createSavepoint(int pos)
@@ -588,6 +613,50 @@ void StateTracker::makeSavepoint(int pos)
 
 	// Looks like a good spot for a savepoint
 	_savepoints.append(createSavepoint(pos));
+
+	compressColdTiles();
+}
+
+/**
+ * @brief Start compressing tiles of old savepoints and hidden layers in the background
+ */
+void StateTracker::compressColdTiles()
+{
+	if(!paintcore::TileCompressor::isEnabled() || _compressjob)
+		return;
+
+	paintcore::TileCompressor compressor;
+	collectTiles(compressor);
+
+	_compressjob = compressor.prepare();
+	if(_compressjob)
+		_compressor.setFuture(QtConcurrent::run(_compressjob, &paintcore::TileCompressionJob::run));
+}
+
+void StateTracker::applyTileCompression()
+{
+	if(!_compressjob)
+		return;
+
+	// The canvas and savepoints may have changed while the job was
+	// running, so the tiles must be collected again.
+	paintcore::TileCompressor compressor;
+	collectTiles(compressor);
+
+	const int released = compressor.apply(_compressjob);
+	qDebug() << "Compressed" << released << "of" << _compressjob->size() << "cold tiles";
+
+	delete _compressjob;
+	_compressjob = 0;
+}
+
+void StateTracker::collectTiles(paintcore::TileCompressor &compressor)
+{
+	compressor.addCanvas(_image);
+	for(int i=_savepoints.count()-1;i>=0;--i) {
+		if(_savepoints.at(i)->canvas)
+			compressor.addSavepoint(_savepoints.at(i)->canvas);
+	}
 }
 
 
@@ -603,6 +672,8 @@ void StateTracker::resetToSavepoint(const StateSavepoint savepoint)
 	_layerlist->setLayers(savepoint->layermodel);
 
 	_savepoints.append(savepoint);
+
+	_image->flushAreaChanged();
 }
 
 void StateTracker::revertSavepoint(const StateSavepoint savepoint)
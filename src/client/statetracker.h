@@ -23,6 +23,7 @@
 
 #include <QObject>
 #include <QHash>
+#include <QFutureWatcher>
 
 #include "core/brush.h"
 #include "core/point.h"
@@ -52,6 +53,8 @@ namespace protocol {
 namespace paintcore {
 	class LayerStack;
 	class Savepoint;
+	class TileCompressor;
+	class TileCompressionJob;
 }
 
 namespace net {
@@ -205,6 +208,9 @@ signals:
 	void userMarkerMove(int id, const QPointF &point, int trail);
 	void userMarkerHide(int id);
 
+private slots:
+	void applyTileCompression();
+
 private:
 	void handleCommand(protocol::MessagePtr msg, bool replay, int pos);
 
@@ -229,6 +235,10 @@ private:
 	void makeSavepoint(int pos);
 	void revertSavepoint(const StateSavepoint savepoint);
 
+	// Cold tile compression
+	void compressColdTiles();
+	void collectTiles(paintcore::TileCompressor &compressor);
+
 	// Annotation related commands
 	void handleAnnotationCreate(const protocol::AnnotationCreate &cmd);
 	void handleAnnotationReshape(const protocol::AnnotationReshape &cmd);
@@ -248,6 +258,9 @@ private:
 	uint _msgstream_sizelimit;
 	bool _hassnapshot;
 	bool _showallmarkers;
+
+	QFutureWatcher<void> _compressor;
+	paintcore::TileCompressionJob *_compressjob;
 };
 
 }
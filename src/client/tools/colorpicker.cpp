@@ -36,11 +36,12 @@ void ColorPicker::motion(const paintcore::Point& point, bool constrain, bool cen
 {
 	Q_UNUSED(constrain);
 	Q_UNUSED(center);
+	const tools::ColorPickerSettings *ts = settings().getColorPickerSettings();
 	int layer=0;
-	if(settings().getColorPickerSettings()->pickFromLayer()) {
+	if(ts->pickFromLayer()) {
 		layer = this->layer();
 	}
-	scene().pickColor(point.x(), point.y(), layer, _bg);
+	scene().pickColor(point.x(), point.y(), layer, ts->getSize(), _bg);
 }
 
 void ColorPicker::end()
@@ -20,6 +20,8 @@
 #include <QDebug>
 #include <QSettings>
 #include <QTimer>
+#include <QSpinBox>
+#include <QLabel>
 
 #include "toolsettings.h"
 #include "docks/layerlistdock.h"
@@ -590,7 +592,7 @@ int SimpleSettings::getSize() const
 }
 
 ColorPickerSettings::ColorPickerSettings(const QString &name, const QString &title)
-	:  QObject(), BrushlessSettings(name, title), _palette(new Palette("Color picker")), _layerpick(0)
+	:  QObject(), BrushlessSettings(name, title), _palette(new Palette("Color picker")), _layerpick(0), _size(0)
 {
 }
 
@@ -609,6 +611,16 @@ QWidget *ColorPickerSettings::createUiWidget(QWidget *parent)
 	_layerpick = new QCheckBox(widget->tr("Pick from current layer only"), widget);
 	layout->addWidget(_layerpick);
 
+	QHBoxLayout *sizelayout = new QHBoxLayout;
+	sizelayout->addWidget(new QLabel(widget->tr("Sample size:"), widget));
+	_size = new QSpinBox(widget);
+	_size->setRange(1, 15);
+	_size->setSuffix(widget->tr("px"));
+	_size->setToolTip(widget->tr("Pick the average color of an area this wide"));
+	sizelayout->addWidget(_size);
+	sizelayout->addStretch();
+	layout->addLayout(sizelayout);
+
 	_palettewidget = new widgets::PaletteWidget(widget);
 	_palettewidget->setPalette(_palette);
 	_palettewidget->setSwatchSize(32, 24);
@@ -623,11 +635,13 @@ QWidget *ColorPickerSettings::createUiWidget(QWidget *parent)
 void ColorPickerSettings::saveToolSettings(QSettings &cfg)
 {
 	cfg.setValue("layerpick", _layerpick->isChecked());
+	cfg.setValue("size", _size->value());
 }
 
 void ColorPickerSettings::restoreToolSettings(QSettings &cfg)
 {
 	_layerpick->setChecked(cfg.value("layerpick", false).toBool());
+	_size->setValue(cfg.value("size", 1).toInt());
 }
 
 bool ColorPickerSettings::pickFromLayer() const
@@ -635,6 +649,11 @@ bool ColorPickerSettings::pickFromLayer() const
 	return _layerpick->isChecked();
 }
 
+int ColorPickerSettings::getSize() const
+{
+	return _size->value();
+}
+
 void ColorPickerSettings::addColor(const QColor &color)
 {
 	if(_palette->count() && _palette->color(0) == color)
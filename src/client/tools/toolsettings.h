@@ -35,6 +35,7 @@ class Ui_LaserSettings;
 class QSettings;
 class QTimer;
 class QCheckBox;
+class QSpinBox;
 
 namespace net {
 	class Client;
@@ -339,6 +340,9 @@ public:
 	//! Pick color from current layer only?
 	bool pickFromLayer() const;
 
+	//! Get the diameter of the area whose average color is picked
+	int getSize() const;
+
 public slots:
 	void addColor(const QColor &color);
 
@@ -354,6 +358,7 @@ private:
 	Palette *_palette;
 	widgets::PaletteWidget *_palettewidget;
 	QCheckBox *_layerpick;
+	QSpinBox *_size;
 };
 
 class SelectionSettings : public BrushlessSettings {
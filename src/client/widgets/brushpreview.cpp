@@ -119,6 +119,8 @@ void BrushPreview::updatePreview()
 {
 	if(preview_==0) {
 		preview_ = new paintcore::LayerStack;
+		// Tiles are rendered in the background
+		connect(preview_, SIGNAL(rendered(QRect)), this, SLOT(update()));
 		QSize size = contentsRect().size();
 		preview_->resize(0, size.width(), size.height(), 0);
 		preview_->addLayer(0, "", QColor(0,0,0));
@@ -157,8 +159,7 @@ void BrushPreview::updatePreview()
 	layer->fillColor(color2_);
 
 	qreal distance = 0;
-	for(int i=1;i<pointvector.size();++i)
-		layer->drawLine(0, brush_, pointvector[i-1], pointvector[i], distance);
+	layer->drawStroke(0, brush_, pointvector, false, distance);
 
 	layer->mergeSublayer(0);
 
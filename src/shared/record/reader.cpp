@@ -98,10 +98,15 @@ Compatibility Reader::open()
 	}
 
 	// Recording made with an older version.
-	// Version 7.1 is fully compatible with current
-	if(protover >= version32(7, 1))
+	// Version 9.2 is fully compatible with current
+	if(protover >= version32(9, 2))
 		return COMPATIBLE;
 
+	// Versions since 7.1 can be played back, but subpixel brush strokes
+	// are rendered slightly differently since 9.2
+	if(protover >= version32(7, 1))
+		return MINOR_INCOMPATIBILITY;
+
 	// Older release with same major version: we know there are minor incompatabilities
 	if(majorVersion(myversion) == majorVersion(protover))
 		return MINOR_INCOMPATIBILITY;